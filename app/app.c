@@ -1,60 +1,339 @@
 #include "app.h"
 
+#include <string.h>
+
 #include "hardware.h"
 
-#define kClockStopped UINT8_MAX;
+#define kClockStopped UINT8_MAX
 
-static void patch_init(state_t* s) {
+// rebuild a row's sequence from its steps and config
+static void sequence_derive(sequence_t* q, row_t row,
+                            const row_config_t* config) {
+    uint8_t length = config->length;
+    if (length == 0 || length > kNumSteps) length = kNumSteps;
+    uint8_t direction = config->direction;
+    if (direction >= kNumDirections) direction = kForward;
+
+    q->length = length;
+    q->direction = direction;
+    q->divisor = config->divisor ? config->divisor : 1;
+    q->cycle = length;
+    if (direction == kPingPong && length > 1) {
+        q->cycle = (uint8_t)(2 * length - 2);
+    }
+
+    q->triggers = 0;
+    for (uint8_t position = 0; position < q->cycle; position++) {
+        uint8_t step = position;
+        if (direction == kReverse) {
+            step = (uint8_t)(length - 1 - position);
+        }
+        else if (position >= length) {  // on the way back
+            step = (uint8_t)(2 * length - 2 - position);
+        }
+        q->steps[position] = step;
+        if ((row >> step) & 1) q->triggers |= (uint32_t)1 << position;
+    }
+}
+
+// flip the trigger bits for the positions that play step, a ping-pong row
+// plays its middle steps twice
+static void sequence_toggle(sequence_t* q, uint8_t step) {
+    if (step >= q->length) return;
+
+    uint8_t position = step;
+    if (q->direction == kReverse) position = (uint8_t)(q->length - 1 - step);
+    q->triggers ^= (uint32_t)1 << position;
+
+    if (q->direction == kPingPong && step > 0 && step < q->length - 1) {
+        q->triggers ^= (uint32_t)1 << (2 * q->length - 2 - step);
+    }
+}
+
+// where a row is in its sequence tick clock ticks after the rows started
+static uint8_t sequence_position(const sequence_t* q, uint32_t tick) {
+    return (uint8_t)(tick / q->divisor % q->cycle);
+}
+
+// whether a row triggers tick clock ticks after the rows started, it only
+// triggers as it moves onto a step
+static bool sequence_triggers(const sequence_t* q, uint32_t tick) {
+    if (tick % q->divisor) return false;
+    return (q->triggers >> sequence_position(q, tick)) & 1;
+}
+
+static uint16_t gcd(uint16_t a, uint16_t b) {
+    while (b) {
+        uint16_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+// clock ticks before every row is back at its start together, 0 if that's
+// longer than kMaxPeriod
+static uint16_t preset_period(const preset_t* p) {
+    uint16_t period = 1;
     for (uint8_t row = 0; row < kNumRows; row++) {
-        for (uint8_t step = 0; step < kNumSteps; step++) {
-            s->patch.rows[row].step[step] = false;
+        const sequence_t* q = &p->sequences[row];
+        uint16_t ticks = (uint16_t)(q->divisor * q->cycle);
+        uint32_t lcm = (uint32_t)(period / gcd(period, ticks)) * ticks;
+        if (lcm > kMaxPeriod) return 0;
+        period = (uint16_t)lcm;
+    }
+    return period;
+}
+
+// write a row's bit of every tick in the trigger table
+static void preset_table_row(preset_t* p, uint8_t row, uint16_t period) {
+    const sequence_t* q = &p->sequences[row];
+    uint8_t bit = (uint8_t)(1 << row);
+    uint8_t position = 0;
+    uint8_t ticks = 0;
+    for (uint16_t tick = 0; tick < period; tick++) {
+        if (ticks == 0 && ((q->triggers >> position) & 1)) {
+            p->triggers[tick] |= bit;
+        }
+        else {
+            p->triggers[tick] &= (uint8_t)~bit;
         }
+        if (++ticks < q->divisor) continue;
+        ticks = 0;
+        if (++position == q->cycle) position = 0;
     }
 }
 
+static void preset_derive(preset_t* p) {
+    // the clock may be playing it, row by row until the table is ready
+    p->period = 0;
+    for (uint8_t row = 0; row < kNumRows; row++) {
+        sequence_derive(&p->sequences[row], p->patch.rows[row],
+                        &p->patch.config[row]);
+    }
+
+    uint16_t period = preset_period(p);
+    for (uint8_t row = 0; row < kNumRows; row++) {
+        preset_table_row(p, row, period);
+    }
+    p->period = period;
+}
+
+static void patch_init(state_t* s) {
+    memset(s->bank, 0, sizeof(s->bank));
+    for (uint8_t i = 0; i < kNumPresets; i++) preset_derive(&s->bank[i]);
+    s->preset = &s->bank[0];
+    s->queued = NULL;
+    s->leds.valid = false;
+}
+
 static void patch_toggle_step(state_t* s, uint8_t row, uint8_t step) {
-    if (row > kNumRows || step > kNumSteps) return;
-    s->patch.rows[row].step[step] = !s->patch.rows[row].step[step];
+    if (row >= kNumRows || step >= kNumSteps) return;
+    preset_t* p = s->preset;
+    p->patch.rows[row] ^= (row_t)(1 << step);
+    // keep the derived sequence and table in sync
+    sequence_toggle(&p->sequences[row], step);
+    preset_table_row(p, row, p->period);
+    s->leds.valid = false;
 }
 
 static bool patch_step_value(state_t* s, uint8_t row, uint8_t step) {
-    if (row > kNumRows || step > kNumSteps) return false;
-    return s->patch.rows[row].step[step];
+    if (row >= kNumRows || step >= kNumSteps) return false;
+    return (s->preset->patch.rows[row] >> step) & 1;
+}
+
+// rows
+
+// the trigger mask for tick clock ticks after the rows started, a lookup
+// where the preset has a table
+static uint8_t rows_triggers(const preset_t* p, uint32_t tick) {
+    if (p->period) return p->triggers[tick % p->period];
+
+    uint8_t triggers = 0;
+    for (uint8_t row = 0; row < kNumRows; row++) {
+        if (sequence_triggers(&p->sequences[row], tick)) {
+            triggers |= (uint8_t)(1 << row);
+        }
+    }
+    return triggers;
+}
+
+// put every row where tick puts it in the current preset, when it changes
+static void rows_place(state_t* s) {
+    const preset_t* p = s->preset;
+    if (p->period) {
+        s->index = (uint16_t)(s->tick % p->period);
+        return;
+    }
+    for (uint8_t row = 0; row < kNumRows; row++) {
+        const sequence_t* q = &p->sequences[row];
+        row_position_t* pos = &s->positions[row];
+        pos->position = sequence_position(q, s->tick);
+        pos->ticks = (uint8_t)(s->tick % q->divisor);
+    }
+}
+
+// move every row on by one clock tick, returns the trigger mask for the rows
+// that moved onto a step that is on, for presets without a table
+static uint8_t rows_tick(const preset_t* p, row_position_t* positions) {
+    uint8_t triggers = 0;
+    for (uint8_t row = 0; row < kNumRows; row++) {
+        const sequence_t* q = &p->sequences[row];
+        row_position_t* pos = &positions[row];
+
+        if (++pos->ticks < q->divisor) continue;
+        pos->ticks = 0;
+        uint8_t next = (uint8_t)(pos->position + 1);
+        pos->position = next < q->cycle ? next : 0;
+        triggers |= (uint8_t)(((q->triggers >> pos->position) & 1) << row);
+    }
+    return triggers;
+}
+
+// rising edges until the queued preset is swapped in
+static uint8_t steps_to_switch(const state_t* s) {
+    if (!s->queued_bar) return 1;
+    // kClockStopped starts again at step 0
+    return s->clock < kNumSteps ? kNumSteps - s->clock : 1;
+}
+
+// redraw tracking
+
+static void redraw_all(state_t* s) {
+    s->redraw_all = true;
+    s->ui_dirty = true;
+}
+
+static void redraw_cell(state_t* s, uint8_t row, uint8_t step) {
+    if (row >= kNumRows || step >= kNumSteps) return;  // e.g. kClockStopped
+    // the clock adds to redraw too
+    uint32_t flags = hardware_irq_save();
+    s->redraw[row] |= (row_t)(1 << step);
+    s->ui_dirty = true;
+    hardware_irq_restore(flags);
 }
 
 void app_init(state_t* s) {
     s->clock = kClockStopped;
-    s->ui_dirty = true;
+    s->tick = 0;
+    s->index = 0;
+    for (uint8_t row = 0; row < kNumRows; row++) {
+        s->redraw[row] = 0;
+        s->playheads[row] = kNumSteps;
+    }
+    redraw_all(s);
     patch_init(s);
 }
 
+void app_load_patch(state_t* s, const patch_t* patch) {
+    app_load_preset(s, app_preset_index(s), patch);
+}
+
+void app_load_preset(state_t* s, uint8_t index, const patch_t* patch) {
+    if (index >= kNumPresets) return;
+
+    preset_t* p = &s->bank[index];
+    p->patch = *patch;
+    preset_derive(p);
+    if (p == s->preset) {
+        // the rows carry on in the new sequences
+        uint32_t flags = hardware_irq_save();
+        rows_place(s);
+        hardware_irq_restore(flags);
+        s->leds.valid = false;
+        redraw_all(s);
+    }
+}
+
+void app_queue_preset(state_t* s, uint8_t index, bool bar) {
+    if (index >= kNumPresets) return;
+
+    // the clock may be reading them from an interrupt
+    uint32_t flags = hardware_irq_save();
+    s->queued_bar = bar;
+    s->queued = &s->bank[index];
+    hardware_irq_restore(flags);
+}
+
+uint8_t app_preset_index(const state_t* s) {
+    return (uint8_t)(s->preset - s->bank);
+}
+
 void app_reset(state_t* s) {
     s->clock = kClockStopped;
+    // the playheads come off at the next refresh
     s->ui_dirty = true;
 }
 
-void app_clock(state_t* s, bool phase) {
-    if (phase) {
-        s->clock = (s->clock + 1) % kNumSteps;  // advance clock (or reset to 0)
-        s->ui_dirty = true;
+// advance the clock and every row, returns the trigger mask for the new step
+static uint8_t clock_tick(state_t* s) {
+    bool start = s->clock == kClockStopped;
+    bool switched = false;
+    preset_t* queued = s->queued;
+    if (queued && steps_to_switch(s) == 1) {
+        // everything derived from the patch is ready, so this is the switch,
+        // at the start of a bar the rows all start again
+        if (s->queued_bar) start = true;
+        s->preset = queued;
+        s->queued = NULL;
+        s->leds.valid = false;
+        redraw_all(s);
+        switched = true;
+    }
 
-        hardware_set_clock_output(true);
+    const preset_t* p = s->preset;
+    if (start) {
+        s->clock = 0;
+        s->tick = 0;
+    }
+    else {
+        s->clock = (uint8_t)((s->clock + 1) % kNumSteps);
+        s->tick++;
+    }
+    // the playheads are found from tick when the grid is refreshed
+    s->ui_dirty = true;
 
-        for (uint8_t row = 0; row < kNumRows; row++) {
-            if (patch_step_value(s, row, s->clock)) {
-                hardware_set_trigger_output(row, true);
-            }
-            else {
-                hardware_set_trigger_output(row, false);
-            }
-        }
+    if (start || switched) {
+        rows_place(s);
+        return rows_triggers(p, s->tick);
+    }
+    if (p->period) {
+        // one lookup, however the rows are set up
+        if (++s->index >= p->period) s->index = 0;
+        return p->triggers[s->index];
+    }
+    return rows_tick(p, s->positions);
+}
+
+void app_clock_advance(state_t* s, bool phase) {
+    if (phase) clock_tick(s);
+}
+
+void app_clock(state_t* s, bool phase) {
+    if (phase) {
+        hardware_set_outputs(clock_tick(s), true);
     }
     else {
-        hardware_set_clock_output(false);
-        for (uint8_t row = 0; row < kNumRows; row++) {
-            hardware_set_trigger_output(row, false);
+        hardware_set_outputs(0, false);
+    }
+}
+
+uint8_t app_triggers_ahead(const state_t* s, uint8_t steps) {
+    if (steps == 0) return 0;
+
+    // the tick steps rising edges on, and the preset clock_tick() will be
+    // playing by then
+    const preset_t* p = s->preset;
+    uint32_t tick = s->clock == kClockStopped ? steps - 1u : s->tick + steps;
+    const preset_t* queued = s->queued;
+    if (queued) {
+        uint8_t switch_at = steps_to_switch(s);
+        if (switch_at <= steps) {
+            if (s->queued_bar) tick = (uint32_t)(steps - switch_at);
+            p = queued;
         }
     }
+    return rows_triggers(p, tick);
 }
 
 void app_grid_press(state_t* s, uint8_t x, uint8_t y, uint8_t z) {
@@ -62,47 +341,122 @@ void app_grid_press(state_t* s, uint8_t x, uint8_t y, uint8_t z) {
     if (z == 0) return;
 
     patch_toggle_step(s, y, x);
-    s->ui_dirty = true;
+    redraw_cell(s, y, x);
 }
 
-void app_refresh(state_t* s) {
+static uint8_t cell_level(state_t* s, uint8_t row, uint8_t step,
+                          bool playhead) {
     const uint8_t kCheckerLed = 2;
+    const uint8_t kOutsideTriggerLed = 4;
     const uint8_t kClockLed = 6;
     const uint8_t kTriggerLed = 10;
     const uint8_t kTriggerClockLed = 15;
 
-    grid_arc_clear();
+    // steps past the end of the row never play
+    bool inside = step < s->preset->sequences[row].length;
 
-    for (uint8_t row = 0; row < kNumRows; row++) {
-        for (uint8_t step = 0; step < kNumSteps; step++) {
-            if (patch_step_value(s, row, step)) {
-                if (step == s->clock)
-                    grid_set(step, row, kTriggerClockLed);
-                else
-                    grid_set(step, row, kTriggerLed);
-            }
-            else if (step == s->clock) {
-                grid_set(step, row, kClockLed);
-            }
-            else {
-                // draw checker board
-                if (((row / 4) % 2) && ((step / 4) % 2)) {
-                    grid_set(step, row, kCheckerLed);
-                }
-                if (!((row / 4) % 2) && !((step / 4) % 2)) {
-                    grid_set(step, row, kCheckerLed);
-                }
+    if (patch_step_value(s, row, step)) {
+        if (playhead)
+            return kTriggerClockLed;
+        else if (inside)
+            return kTriggerLed;
+        else
+            return kOutsideTriggerLed;
+    }
+    else if (playhead) {
+        return kClockLed;
+    }
+    else if (inside) {
+        // draw checker board
+        if (((row / 4) % 2) && ((step / 4) % 2)) return kCheckerLed;
+        if (!((row / 4) % 2) && !((step / 4) % 2)) return kCheckerLed;
+    }
+    return 0;
+}
+
+// the LED frame for the current preset and playheads
+static const led_frame_t* led_frame(state_t* s) {
+    led_cache_t* c = &s->leds;
+
+    // marked valid before rebuilding, so that the clock throwing it away
+    // part way through is rebuilt again on the next refresh
+    uint32_t flags = hardware_irq_save();
+    bool rebuild = !c->valid;
+    c->valid = true;
+    hardware_irq_restore(flags);
+
+    if (rebuild) {
+        for (uint8_t row = 0; row < kNumRows; row++) {
+            for (uint8_t step = 0; step < kNumSteps; step++) {
+                c->stopped[row][step] = cell_level(s, row, step, false);
             }
         }
     }
 
-    // set the grid as being dirty
-    grid_set_dirty(0);
-    grid_set_dirty(1);
-    // do the refresh
-    grid_refresh();
+    if (s->clock >= kNumSteps) return &c->stopped;
+
+    // the rows move independently, so draw each playhead over a copy
+    memcpy(c->frame, c->stopped, sizeof(led_frame_t));
+    for (uint8_t row = 0; row < kNumRows; row++) {
+        uint8_t step = s->playheads[row];
+        if (step >= kNumSteps) continue;
+        c->frame[row][step] = cell_level(s, row, step, true);
+    }
+    return &c->frame;
+}
+
+void app_refresh(state_t* s) {
+    uint8_t quadrants = 0;
+
+    // take what needs redrawing, anything the clock changes after this is
+    // left for the next refresh
+    uint32_t flags = hardware_irq_save();
+    bool all = s->redraw_all;
+    s->redraw_all = false;
+    row_t redraw[kNumRows];
+    memcpy(redraw, s->redraw, sizeof(redraw));
+    memset(s->redraw, 0, sizeof(s->redraw));
     // mark the ui as clean
     s->ui_dirty = false;
+    bool running = s->clock < kNumSteps;
+    uint32_t tick = s->tick;
+    const preset_t* p = s->preset;
+    hardware_irq_restore(flags);
+
+    // the clock only counts ticks, so the cells the playheads have left and
+    // landed on since the last refresh are found here
+    for (uint8_t row = 0; row < kNumRows; row++) {
+        const sequence_t* q = &p->sequences[row];
+        uint8_t step = kNumSteps;
+        if (running) step = q->steps[sequence_position(q, tick)];
+        uint8_t drawn = s->playheads[row];
+        if (step == drawn) continue;
+        if (drawn < kNumSteps) redraw[row] |= (row_t)(1 << drawn);
+        if (step < kNumSteps) redraw[row] |= (row_t)(1 << step);
+        s->playheads[row] = step;
+    }
+
+    if (all) {
+        grid_arc_clear();
+        quadrants = 0x3;
+    }
+
+    // only mark the quadrants with changed cells as dirty
+    for (uint8_t row = 0; row < kNumRows; row++) {
+        uint8_t q = (row / 8) * 2;
+        if (redraw[row] & 0x00FF) quadrants |= (uint8_t)(1 << q);
+        if (redraw[row] & 0xFF00) quadrants |= (uint8_t)(1 << (q + 1));
+    }
+
+    // the whole frame is a single copy
+    grid_copy_rows(0, kNumRows, &(*led_frame(s))[0][0]);
+
+    // set the changed quadrants as being dirty
+    for (uint8_t q = 0; q < 4; q++) {
+        if ((quadrants >> q) & 1) grid_set_dirty(q);
+    }
+    // do the refresh
+    grid_refresh();
 }
 
 bool app_grid_is_dirty(state_t* s) {
@@ -5,25 +5,123 @@
 #include <stdint.h>
 
 #define kNumSteps 16
+// bit n is set if step n is on
+typedef uint16_t row_t;
+
+typedef enum {
+    kForward,
+    kReverse,
+    kPingPong,
+    kNumDirections
+} direction_t;
+
+// how a row plays its steps, all zeros plays the whole row forwards once per
+// clock tick
 typedef struct {
-    bool step[kNumSteps];
-} row_t;
+    uint8_t length;     // steps from step 0, 1 to kNumSteps, 0 for kNumSteps
+    uint8_t divisor;    // clock ticks per step, 0 for 1
+    uint8_t direction;  // direction_t
+} row_config_t;
 
 #define kNumRows 8
 typedef struct {
     row_t rows[kNumRows];
+    row_config_t config[kNumRows];
 } patch_t;
 
+// a ping-pong row visits its end steps once per cycle
+#define kMaxCycle (2 * kNumSteps - 2)
+
+// a row's steps in the order it plays them
+typedef struct {
+    uint32_t triggers;         // bit n is set if the row triggers at position n
+    uint8_t steps[kMaxCycle];  // the step at each position
+    uint8_t cycle;             // positions before the row starts again
+    uint8_t divisor;           // clock ticks per position
+    uint8_t length;
+    uint8_t direction;
+} sequence_t;
+
+// the longest the rows' combined triggers can take to repeat and still be
+// tabled, in clock ticks
+#define kMaxPeriod 256
+
+// a patch with the tables derived from it, ready to play
+typedef struct {
+    patch_t patch;
+    sequence_t sequences[kNumRows];
+    // clock ticks before every row is back at its start together, 0 if that
+    // is longer than kMaxPeriod and the rows are played one by one instead
+    uint16_t period;
+    // the trigger mask for each clock tick of the period
+    uint8_t triggers[kMaxPeriod];
+} preset_t;
+
+// where a row is in its sequence, for presets without a trigger table
+typedef struct {
+    uint8_t position;
+    uint8_t ticks;  // clock ticks since it moved
+} row_position_t;
+
+#define kNumPresets 8
+
+// LED levels for the patch rows, the same layout as the grid's LED buffer
+typedef uint8_t led_frame_t[kNumRows][kNumSteps];
+
+// the current preset drawn without playheads, built on demand and thrown
+// away when the preset changes, the playheads are drawn over a copy of it
+typedef struct {
+    led_frame_t stopped;  // no playheads
+    led_frame_t frame;    // stopped with every row's playhead
+    bool valid;           // stopped is up to date
+} led_cache_t;
+
 typedef struct {
-    // only 16 steps...
+    // ticks through the 16 tick bar
     uint8_t clock;
+    // clock ticks since the rows started, every row's place in its sequence
+    // follows from it
+    uint32_t tick;
+    // tick within the preset's period, when it has a trigger table
+    uint16_t index;
+    // every row's place, when it doesn't
+    row_position_t positions[kNumRows];
+    // the step each row's playhead is drawn on, kNumSteps for none
+    uint8_t playheads[kNumRows];
     // is the UI dirty? (i.e. does the grid need redrawing)
     bool ui_dirty;
-    patch_t patch;
+    // clear and redraw the whole grid on the next refresh
+    bool redraw_all;
+    // cells to redraw on the next refresh, bit n is step n of that row
+    row_t redraw[kNumRows];
+    preset_t bank[kNumPresets];
+    // the preset that is playing and being edited, one of bank
+    preset_t *preset;
+    // swapped in for preset on the next rising clock edge, or the next one
+    // back at step 0 if queued_bar is set, NULL if nothing is queued, both
+    // set together with the clock held off
+    preset_t *volatile queued;
+    volatile bool queued_bar;
+    led_cache_t leds;
 } state_t;
 
 void app_init(state_t *state);
+// load into the current preset
+void app_load_patch(state_t *state, const patch_t *patch);
+// load into one of the bank's presets
+void app_load_preset(state_t *state, uint8_t index, const patch_t *patch);
+// switch to a preset from the bank on the next rising clock edge, or at the
+// start of the next bar, mid bar every row goes on from where the clock puts
+// it in the new preset
+void app_queue_preset(state_t *state, uint8_t index, bool bar);
+uint8_t app_preset_index(const state_t *state);
 void app_clock(state_t *state, bool phase);
+// app_clock() without setting the outputs, for when the platform has already
+// driven them from app_triggers_ahead()
+void app_clock_advance(state_t *state, bool phase);
+// the trigger mask for the step steps rising clock edges after the current
+// one, cheap enough to call from an interrupt handler for a few steps
+uint8_t app_triggers_ahead(const state_t *state, uint8_t steps);
 void app_grid_press(state_t *state, uint8_t x, uint8_t y, uint8_t z);
 void app_reset(state_t *state);
 void app_refresh(state_t *state);
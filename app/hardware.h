@@ -4,12 +4,21 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-void hardware_set_clock_output(bool val);
-void hardware_set_trigger_output(uint8_t idx, bool val);
+// set all outputs at once, bit n of trigger_mask drives trigger output n,
+// outputs that are already at the requested level are left untouched
+void hardware_set_outputs(uint8_t trigger_mask, bool clock);
+
+// keep the clock from running the app in between, for the state the clock
+// and the rest of the app hand over to each other, the returned flags go
+// back to hardware_irq_restore()
+uint32_t hardware_irq_save(void);
+void hardware_irq_restore(uint32_t flags);
 
 void grid_set_dirty(uint8_t quadrant);
 void grid_arc_clear(void);
 void grid_set(uint8_t x, uint8_t y, uint8_t level);
+// copy whole 16 LED rows into the LED buffer, starting at row y
+void grid_copy_rows(uint8_t y, uint8_t rows, const uint8_t *levels);
 void grid_refresh(void);
 
 #endif
@@ -63,6 +63,8 @@ TARGET = $(THIS).elf
 CSRCS = \
        ../meadowphysics/main.c                            \
        ../meadowphysics/init_meadowphysics.c              \
+       ../meadowphysics/profile.c                         \
+       ../meadowphysics/store.c                           \
        $(addprefix ../../app/,$(APP_CSRCS))               \
        ../libavr32/src/adc.c                              \
        ../libavr32/src/events.c                           \
@@ -182,6 +184,11 @@ CFLAGS = -fno-common
 #   EXT_BOARD  Optional extension board in use, see boards/board.h for a list.
 CPPFLAGS = -D BOARD=USER_BOARD -D UHD_ENABLE
 
+# Cycle profiler for the event handlers and interrupts, 'make PROFILE=1'
+ifeq ($(PROFILE),1)
+CPPFLAGS += -D MP_PROFILE
+endif
+
 # Extra flags to use when linking
 LDFLAGS = -Wl,-e,_trampoline
 
@@ -1,6 +1,7 @@
 // ASF
 #include <sysclk.h>
 
+#include "compiler.h"
 #include "gpio.h"
 #include "intc.h"
 #include "print_funcs.h"
@@ -15,14 +16,35 @@
 #include "types.h"
 
 #include "init_meadowphysics.h"
+#include "profile.h"
 
 
 // timer tick counter
 static volatile uint64_t tcTicks = 0;
 
-static void clock_null(uint8_t phase) {}
+// events lost to a full event queue
+static volatile uint32_t eventsDropped = 0;
+
+static void clock_null(uint8_t phase, uint32_t sys_count) {}
 volatile clock_pulse_t clock_pulse = &clock_null;
 
+static void clock_tick_null(void) {}
+volatile clock_tick_t clock_tick = &clock_tick_null;
+
+// clock timer, half periods longer than the 16 bit counter are counted in
+// segments of up to 0xFFFF ticks
+#define kClockTcHz (FPBA_HZ / 32)
+// the counter runs on while the interrupt is getting to tc_write_rc(), a
+// shorter segment could be passed before it is written and the counter would
+// wrap all the way round, about 140us
+#define kClockTcMinSegment 256
+// requested half period, ticks
+static volatile uint32_t clockTcPeriod = 0;
+// the half period the current half is being counted against, ticks
+static uint32_t clockTcApplied = 0;
+// ticks left in the current half after the segment being counted
+static uint32_t clockTcRemaining = 0;
+
 // interrupt handlers
 
 // irq for app timer
@@ -34,40 +56,98 @@ __attribute__((__interrupt__)) static void irq_port0_line1(void);
 // irq for PB08-PB15
 __attribute__((__interrupt__)) static void irq_port1_line1(void);
 
+// irq for the internal clock
+__attribute__((__interrupt__)) static void irq_clock_tc(void);
+
 // timer irq
 __attribute__((__interrupt__)) static void irq_tc(void) {
+    PROFILE_START();
     tcTicks++;
     process_timers();
     // clear interrupt flag by reading timer SR
     tc_read_sr(APP_TC, APP_TC_CHANNEL);
+    PROFILE_END(PROFILE_IRQ(kProfileIrqTc));
+}
+
+static uint32_t clock_tc_ticks(uint32_t us) {
+    if (us > kMaxClockHalfPeriodUs) us = kMaxClockHalfPeriodUs;
+    // divides by constants only
+    uint32_t ticks = us * (kClockTcHz / 1000) / 1000;
+    return ticks > kClockTcMinSegment ? ticks : kClockTcMinSegment;
+}
+
+// count the next segment of the current half period
+static void clock_tc_schedule(void) {
+    uint32_t segment = clockTcRemaining;
+    if (segment > 0xFFFF) {
+        // split the last two segments evenly so that neither is too short
+        // to get to the interrupt in time
+        segment = segment >= 0x1FFFE ? 0xFFFF : segment >> 1;
+    }
+    clockTcRemaining -= segment;
+    tc_write_rc(APP_TC, CLOCK_TC_CHANNEL, segment);
+}
+
+__attribute__((__interrupt__)) static void irq_clock_tc(void) {
+    PROFILE_START();
+    // clear interrupt flag by reading timer SR
+    tc_read_sr(APP_TC, CLOCK_TC_CHANNEL);
+
+    uint32_t period = clockTcPeriod;
+    if (period != clockTcApplied) {
+        // 64 bit divide, but only when the tempo changes
+        clockTcRemaining =
+            (uint32_t)((uint64_t)clockTcRemaining * period / clockTcApplied);
+        clockTcApplied = period;
+        // too short to count, so it's folded into the segment that just ended
+        if (clockTcRemaining < kClockTcMinSegment) clockTcRemaining = 0;
+    }
+
+    if (clockTcRemaining == 0) {
+        (*clock_tick)();
+        clockTcRemaining = clockTcApplied;
+    }
+    clock_tc_schedule();
+    PROFILE_END(PROFILE_IRQ(kProfileIrqClockTc));
 }
 
 // interrupt handler for PA08-PA15
 __attribute__((__interrupt__)) static void irq_port0_line1(void) {
+    PROFILE_START();
     if (gpio_get_pin_interrupt_flag(NMI)) {
         gpio_clear_pin_interrupt_flag(NMI);
         event_t e = { .type = kEventFront, .data = !gpio_get_pin_value(NMI) };
-        event_post(&e);
+        post_event(&e);
     }
+    PROFILE_END(PROFILE_IRQ(kProfileIrqPort0Line1));
 }
 
 // interrupt handler for PB08-PB15
 __attribute__((__interrupt__)) static void irq_port1_line1(void) {
+    PROFILE_START();
+
     // clock norm
     if (gpio_get_pin_interrupt_flag(B09)) {
         event_t e = { .type = kEventClockNormal,
                       .data = !gpio_get_pin_value(B09) };
-        event_post(&e);
+        post_event(&e);
 
         gpio_clear_pin_interrupt_flag(B09);
     }
 
     // clock in
     if (gpio_get_pin_interrupt_flag(B08)) {
-        event_t e = { .type = kEventClockExt, .data = gpio_get_pin_value(B08) };
-        event_post(&e);
+        // timestamp the edge before anything else
+        uint32_t sys_count = Get_sys_count();
+        uint8_t phase = gpio_get_pin_value(B08);
+        (*clock_pulse)(phase, sys_count);
+
+        event_t e = { .type = kEventClockExt, .data = phase };
+        post_event(&e);
         gpio_clear_pin_interrupt_flag(B08);
     }
+
+    PROFILE_END(PROFILE_IRQ(kProfileIrqPort1Line1));
 }
 
 // register interrupts
@@ -89,6 +169,58 @@ void register_interrupts(void) {
 
     // register TC interrupt
     INTC_register_interrupt(&irq_tc, APP_TC_IRQ, UI_IRQ_PRIORITY);
+
+    // the clock timer
+    INTC_register_interrupt(&irq_clock_tc, CLOCK_TC_IRQ, UI_IRQ_PRIORITY);
+}
+
+extern void init_clock_tc(uint32_t half_period_us) {
+    // the TC module is already clocked for APP_TC_CHANNEL by init_tc()
+    static const tc_waveform_opt_t waveform_opt = {
+        .channel = CLOCK_TC_CHANNEL,
+        .bswtrg = TC_EVT_EFFECT_NOOP,
+        .beevt = TC_EVT_EFFECT_NOOP,
+        .bcpc = TC_EVT_EFFECT_NOOP,
+        .bcpb = TC_EVT_EFFECT_NOOP,
+        .aswtrg = TC_EVT_EFFECT_NOOP,
+        .aeevt = TC_EVT_EFFECT_NOOP,
+        .acpc = TC_EVT_EFFECT_NOOP,
+        .acpa = TC_EVT_EFFECT_NOOP,
+        .wavsel = TC_WAVEFORM_SEL_UP_MODE_RC_TRIGGER,
+        .enetrg = false,
+        .eevt = 0,
+        .eevtedg = TC_SEL_NO_EDGE,
+        .cpcdis = false,
+        .cpcstop = false,
+        .burst = TC_BURST_NOT_GATED,
+        .clki = TC_CLOCK_RISING_EDGE,
+        .tcclks = TC_CLOCK_SOURCE_TC4  // FPBA_HZ / 32
+    };
+    static const tc_interrupt_t tc_interrupt = { .etrgs = 0,
+                                                 .ldrbs = 0,
+                                                 .ldras = 0,
+                                                 .cpcs = 1,
+                                                 .cpbs = 0,
+                                                 .cpas = 0,
+                                                 .lovrs = 0,
+                                                 .covfs = 0 };
+
+    tc_init_waveform(APP_TC, &waveform_opt);
+    clock_tc_restart_us(half_period_us);
+    tc_configure_interrupts(APP_TC, CLOCK_TC_CHANNEL, &tc_interrupt);
+}
+
+extern void clock_tc_set_period_us(uint32_t half_period_us) {
+    // picked up by the interrupt at the end of the current segment
+    clockTcPeriod = clock_tc_ticks(half_period_us);
+}
+
+extern void clock_tc_restart_us(uint32_t half_period_us) {
+    clockTcPeriod = clockTcApplied = clockTcRemaining =
+        clock_tc_ticks(half_period_us);
+    clock_tc_schedule();
+    // reset the counter and start counting the first segment
+    tc_start(APP_TC, CLOCK_TC_CHANNEL);
 }
 
 extern void init_gpio(void) {
@@ -155,6 +287,16 @@ extern void init_spi(void) {
     spi_setupChipReg(SPI, &spiOptions, FPBA_HZ);
 }
 
+extern bool post_event(event_t* e) {
+    if (event_post(e)) return true;
+    eventsDropped++;
+    return false;
+}
+
+extern uint32_t get_events_dropped(void) {
+    return eventsDropped;
+}
+
 extern uint64_t get_ticks(void) {
     return tcTicks;
 }
@@ -1,11 +1,38 @@
 #ifndef _INIT_MEADOWPHYSICS_H_
 #define _INIT_MEADOWPHYSICS_H_
 
+#include "events.h"
 #include "types.h"
 
-typedef void (*clock_pulse_t)(uint8_t phase);
+// called from the B08 interrupt on every external clock edge, before the
+// kEventClockExt event is posted, with Get_sys_count() at the edge
+typedef void (*clock_pulse_t)(uint8_t phase, uint32_t sys_count);
 extern volatile clock_pulse_t clock_pulse;
 
+// event_post(), counting the events lost to a full queue
+extern bool post_event(event_t* e);
+extern uint32_t get_events_dropped(void);
+
+// the internal clock has a timer channel of its own, next to libavr32's
+// APP_TC_CHANNEL, counting at FPBA_HZ / 32
+#define CLOCK_TC_CHANNEL 1
+#define CLOCK_TC_IRQ AVR32_TC_IRQ1
+// longest half period the clock timer can count
+#define kMaxClockHalfPeriodUs 2000000
+
+// called from the clock timer interrupt at the end of every half period
+typedef void (*clock_tick_t)(void);
+extern volatile clock_tick_t clock_tick;
+
+// start the clock timer, ticking every half_period_us
+extern void init_clock_tc(uint32_t half_period_us);
+// change the half period, the phase carries on through the change, so the
+// rest of the current half takes the same fraction of the new period
+extern void clock_tc_set_period_us(uint32_t half_period_us);
+// change the half period and start a new half now, call with interrupts
+// masked or from an interrupt at UI_IRQ_PRIORITY
+extern void clock_tc_restart_us(uint32_t half_period_us);
+
 extern void register_interrupts(void);
 extern void init_gpio(void);
 extern void init_spi(void);
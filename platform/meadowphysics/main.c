@@ -5,7 +5,6 @@
 #include "avr32_reset_cause.h"
 #include "compiler.h"
 #include "delay.h"
-#include "flashc.h"
 #include "gpio.h"
 #include "intc.h"
 #include "pm.h"
@@ -32,6 +31,8 @@
 #include "conf_board.h"
 
 #include "init_meadowphysics.h"
+#include "profile.h"
+#include "store.h"
 
 #include "app.h"
 #include "hardware.h"
@@ -45,42 +46,67 @@ const uint32_t kClockNormal = B09;
 const uint32_t kClockOut = B10;
 
 #define kNumClockTracking 8
+// longer gaps between edges are the clock stopping, not a tempo
+#define kMaxClockPeriodMs 4000
 
 typedef struct {
     uint16_t front_held_timer;
+    bool front_chorded;  // a grid key was pressed while the button was down
     bool clock_phase;
-    uint16_t clock_time;
-    uint16_t clock_prev;
-    bool clock_external;
-    intptr_t clock_tracking_idx;
-    int32_t clock_tracking[kNumClockTracking];
-    uint32_t last_sys_count;
+    uint32_t clock_time;   // internal clock half period, us
+    uint16_t knob;         // filtered clock knob, 10 bits << kKnobShift
+    uint16_t knob_prev;    // the knob position clock_time is from
+    volatile bool clock_external;
+    // written by the B08 interrupt
+    volatile intptr_t clock_tracking_idx;
+    volatile int32_t clock_tracking[kNumClockTracking];
+    volatile uint32_t last_sys_count;
+    volatile bool clock_tracking_overflow;
+    // steps whose outputs an interrupt has set but that the event loop
+    // hasn't advanced the app for yet
+    volatile uint8_t clock_ext_pending;
+    // following the external clock, only touched in interrupt context apart
+    // from clock_ratio
+    volatile int8_t clock_ratio;  // steps per edge, negative to divide
+    uint32_t clock_ext_period;    // estimated edge period, cycles
+    uint8_t clock_ext_edges;      // edges since the last aligned step
+    uint8_t clock_sub_step;       // steps since the last aligned step
+    uint8_t clock_predicted;      // aligned steps predicted in a row
+    bool clock_step_predicted;    // the last step was predicted
+    uint32_t clock_step_count;    // Get_sys_count() at the last step
 } hardware_state_t;
 
 // hardware.h
 
-// 'static inline' in a header file?
-void hardware_set_trigger_output(uint8_t idx, bool val) {
-    if (idx >= kNumOutputs) return;
+// B00 - B07 (triggers) and B10 (clock) are PB00 - PB07 and PB10, so every
+// output lives on the same GPIO port and can be updated with one write to
+// each of its set and clear registers
+#define kOutputPort (B00 >> 5)
+#define kOutputTriggerShift (B00 & 0x1F)
+#define kOutputClockBit (1 << (B10 & 0x1F))
+#define kOutputMask ((0xFF << kOutputTriggerShift) | kOutputClockBit)
 
-    uint32_t pin = kOutputs[idx];
+void hardware_set_outputs(uint8_t trigger_mask, bool clock) {
+    volatile avr32_gpio_port_t* port = &AVR32_GPIO.port[kOutputPort];
 
-    if (val) {
-        gpio_set_gpio_pin(pin);
-    }
-    else {
-        gpio_clr_gpio_pin(pin);
-    }
+    uint32_t want = (uint32_t)trigger_mask << kOutputTriggerShift;
+    if (clock) want |= kOutputClockBit;
+
+    // set and clear only the pins whose level differs, the writes can be
+    // repeated without harm if the port changes in between
+    uint32_t ovr = port->ovr;
+    uint32_t set = want & ~ovr & kOutputMask;
+    uint32_t clr = ~want & ovr & kOutputMask;
+    port->ovrs = set;
+    port->ovrc = clr;
 }
 
-// 'static inline' in a header file?
-void hardware_set_clock_output(bool val) {
-    if (val) {
-        gpio_set_gpio_pin(kClockOut);
-    }
-    else {
-        gpio_clr_gpio_pin(kClockOut);
-    }
+uint32_t hardware_irq_save(void) {
+    return cpu_irq_save();
+}
+
+void hardware_irq_restore(uint32_t flags) {
+    cpu_irq_restore(flags);
 }
 
 void grid_set_dirty(uint8_t quadrant) {
@@ -95,6 +121,13 @@ void grid_set(uint8_t x, uint8_t y, uint8_t level) {
     monome_led_set(x, y, level);
 }
 
+void grid_copy_rows(uint8_t y, uint8_t rows, const uint8_t* levels) {
+    // the LED buffer is 16 levels per row
+    if (y >= 16) return;
+    if (rows > 16 - y) rows = 16 - y;
+    memcpy(monomeLedBuffer + (y << 4), levels, rows << 4);
+}
+
 void grid_refresh() {
     (*monome_refresh)();
 }
@@ -103,22 +136,14 @@ void grid_refresh() {
 
 static hardware_state_t hw_state = {
     .front_held_timer = 0,
-    .clock_prev = UINT16_MAX  // out of ADC range to force tempo
+    .knob = UINT16_MAX,       // out of ADC range until the first reading
+    .knob_prev = UINT16_MAX,  // out of ADC range to force tempo
+    .clock_ratio = 1
 };
 
 static state_t state;
 
-typedef const struct {
-    uint8_t fresh;  // this will hold 0xFF when it hasn't been used yet
-    patch_t patch;
-} nvram_data_t;
-
-// NVRAM data structure located in the flash array.
-__attribute__((__section__(".flash_nvram"))) static nvram_data_t flash;
-
-static bool flash_empty(void);
-static void flash_read(state_t* s);
-static void flash_write(state_t* s);
+static void debug_events(void);
 
 ////////////////////////////////////////////////////////////////////////////////
 // clock tracking
@@ -127,6 +152,8 @@ static void flash_write(state_t* s);
 // 71 seconds.
 
 static void debug_clock_tracking(void) {
+    print_dbg("\r\nperiod: ");
+    print_dbg_ulong(hw_state.clock_ext_period);
     print_dbg("\r\n");
     for (intptr_t i = 0; i < kNumClockTracking; i++) {
         int32_t v = hw_state.clock_tracking[i];
@@ -147,42 +174,51 @@ static void empty_clock_tracking(void) {
     hw_state.clock_tracking_idx = 0;
 }
 
-static void save_clock_tracking(void) {
-    uint32_t sc = Get_sys_count();
+// called from the B08 interrupt with the time of the edge
+static void save_clock_tracking(uint32_t sc) {
     uint32_t lsc = hw_state.last_sys_count;
 
-    int32_t last = hw_state.clock_tracking[hw_state.clock_tracking_idx];
+    // unsigned subtraction gives the right period across an overflow
+    uint32_t period = sc - lsc;
+    bool overflow = sc < lsc;
+    hw_state.last_sys_count = sc;
 
-    bool overflow = false;
+    // the clock stopped, start tracking the new tempo from scratch
+    if (period > kMaxClockPeriodMs * (sysclk_get_cpu_hz() / 1000)) {
+        empty_clock_tracking();
+        return;
+    }
 
+    int32_t last = hw_state.clock_tracking[hw_state.clock_tracking_idx];
     if (last != -1) {  // only increment idx if there is a value
         hw_state.clock_tracking_idx++;
         if (hw_state.clock_tracking_idx >= kNumClockTracking) {
             hw_state.clock_tracking_idx = 0;
         }
     }
+    hw_state.clock_tracking[hw_state.clock_tracking_idx] = (int32_t)period;
 
-    if (sc > lsc) {
-        hw_state.clock_tracking[hw_state.clock_tracking_idx] = sc - lsc;
-    }
-    else if (sc < lsc) {  // overflow
-        overflow = true;
-        int32_t v = (UINT32_MAX - lsc) + sc;
-        hw_state.clock_tracking[hw_state.clock_tracking_idx] = v;
-    }
+    // too slow to print here, handler_ClockExt() reports it
+    if (overflow) hw_state.clock_tracking_overflow = true;
+}
 
-    hw_state.last_sys_count = sc;
+// the median tracked period, so that a single early, late or missing edge
+// doesn't move the tempo, 0 if nothing has been tracked
+static uint32_t clock_tracking_median(void) {
+    uint32_t sorted[kNumClockTracking];
+    intptr_t n = 0;
+    for (intptr_t i = 0; i < kNumClockTracking; i++) {
+        int32_t v = hw_state.clock_tracking[i];
+        if (v == -1) continue;
 
-    if (overflow) {
-        print_dbg("\r\nOVERFLOW:");
-        debug_clock_tracking();
+        intptr_t j = n++;
+        while (j > 0 && sorted[j - 1] > (uint32_t)v) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = v;
     }
-    // print_dbg("\r\n\r\nlsc: ");
-    // print_dbg_ulong(lsc);
-    // print_dbg("\r\nsc: ");
-    // print_dbg_ulong(sc);
-    // print_dbg("\r\nsc - lsc: ");
-    // print_dbg_ulong(sc - lsc);
+    return n ? sorted[n / 2] : 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -192,9 +228,6 @@ static void save_clock_tracking(void) {
 ////////////////////////////////////////////////////////////////////////////////
 // timers
 
-// used by the internal clock generator when no external clock is used
-static softTimer_t clockTimer = { .next = NULL, .prev = NULL };
-
 // used to detect long presses
 static softTimer_t keyTimer = { .next = NULL, .prev = NULL };
 
@@ -207,22 +240,171 @@ static softTimer_t monomePollTimer = { .next = NULL, .prev = NULL };
 // how often to ask the app if it needs to update the grid/arc state
 static softTimer_t monomeRefreshTimer = { .next = NULL, .prev = NULL };
 
+////////////////////////////////////////////////////////////////////////////////
+// external clock following
+//
+// With an external clock patched the sequencer runs at a multiple or
+// division of it, picked with the clock knob. Steps come from the clock
+// timer, running at the step period worked out from the estimated external
+// period, and every aligned external edge (every edge, or every nth when
+// dividing) pulls its phase back into line. If an edge goes missing the
+// timer predicts the step on time and carries on. All of this runs in
+// interrupt context.
+
+// clock knob positions with an external clock, negative values divide
+static const int8_t kClockRatios[] = { -4, -2, 1, 2, 4 };
+#define kNumClockRatios (sizeof(kClockRatios) / sizeof(kClockRatios[0]))
+
+// an aligned edge within this fraction of a step of a predicted step is
+// that step's late edge, rather than a new step
+#define kClockLateFraction 4
+// aligned steps predicted in a row before assuming the clock has stopped
+#define kMaxPredictedSteps 2
+// the shortest the outputs are held low between two steps, us
+#define kClockMinLowUs 50
+
+static uint8_t clock_steps_per_edge(void) {
+    int8_t ratio = hw_state.clock_ratio;
+    return ratio > 0 ? ratio : 1;
+}
+
+// cycles between steps
+static uint32_t clock_step_period(void) {
+    int8_t ratio = hw_state.clock_ratio;
+    if (ratio > 0) return hw_state.clock_ext_period / ratio;
+    return hw_state.clock_ext_period * -ratio;
+}
+
+// the clock timer toggles the phase, so it runs at half the step period
+static uint32_t clock_half_step_us(void) {
+    return clock_step_period() / 2 / (sysclk_get_cpu_hz() / 1000000);
+}
+
+static void clock_follow_rise(bool predicted) {
+    // drive the outputs now, the event loop advances the app to match
+    hw_state.clock_ext_pending++;
+    hardware_set_outputs(
+        app_triggers_ahead(&state, hw_state.clock_ext_pending), true);
+    hw_state.clock_phase = true;
+    hw_state.clock_step_count = Get_sys_count();
+    hw_state.clock_step_predicted = predicted;
+}
+
+static void clock_follow_fall(void) {
+    hardware_set_outputs(0, false);
+    hw_state.clock_phase = false;
+}
+
+static void clock_follow_reset(void) {
+    hw_state.clock_ext_edges = 0;
+    hw_state.clock_sub_step = 0;
+    hw_state.clock_predicted = 0;
+    hw_state.clock_step_predicted = false;
+}
+
+// B08 interrupt
+static void clock_ext_pulse(uint8_t phase, uint32_t sys_count) {
+    if (!hw_state.clock_external) return;
+
+    if (!phase) {
+        // until there's a tempo the outputs just follow the external clock
+        if (!hw_state.clock_ext_period) clock_follow_fall();
+        return;
+    }
+
+    save_clock_tracking(sys_count);
+    hw_state.clock_ext_period = clock_tracking_median();
+    if (!hw_state.clock_ext_period) {
+        clock_follow_rise(false);
+        return;
+    }
+
+    // when dividing, only every nth edge lines up with a step
+    int8_t ratio = hw_state.clock_ratio;
+    if (ratio < 0 && ++hw_state.clock_ext_edges < -ratio) return;
+    hw_state.clock_ext_edges = 0;
+    hw_state.clock_predicted = 0;
+
+    uint32_t step = clock_step_period();
+    bool covered = hw_state.clock_step_predicted &&
+                   hw_state.clock_sub_step == 0 &&
+                   sys_count - hw_state.clock_step_count <
+                       step / kClockLateFraction;
+    if (!covered) {
+        hw_state.clock_sub_step = 0;
+        // early, while a sub-step is still high, the outputs go low first so
+        // that every trigger is a separate pulse
+        if (hw_state.clock_phase) {
+            clock_follow_fall();
+            delay_us(kClockMinLowUs);
+        }
+        clock_follow_rise(false);
+    }
+    // line the timer up with this edge, the next toggle is the fall
+    clock_tc_restart_us(clock_half_step_us());
+}
+
+// the clock timer, while following an external clock
+static void clock_follow_tick(void) {
+    if (!hw_state.clock_ext_period) return;  // no tempo yet
+
+    if (hw_state.clock_phase) {
+        clock_follow_fall();
+        return;
+    }
+
+    uint8_t next = hw_state.clock_sub_step + 1;
+    if (next < clock_steps_per_edge()) {
+        hw_state.clock_sub_step = next;
+        clock_follow_rise(false);
+    }
+    else {
+        // the aligned edge should be here now, predict it in case it's late
+        // or missing, unless it's been missing for too long
+        if (hw_state.clock_predicted >= kMaxPredictedSteps) return;
+        hw_state.clock_predicted++;
+        hw_state.clock_sub_step = 0;
+        clock_follow_rise(true);
+    }
+
+    event_t e = { .type = kEventClockExt, .data = 1 };
+    post_event(&e);
+}
+
+// the knob picks the ratio when an external clock is patched
+static void clock_follow_set_ratio(uint16_t knob) {
+    int8_t ratio = kClockRatios[(knob * kNumClockRatios) >> 10];
+    if (ratio == hw_state.clock_ratio) return;
 
-static void clockTimer_callback(void* o) {
+    irqflags_t flags = cpu_irq_save();
+    hw_state.clock_ratio = ratio;
+    clock_follow_reset();
+    cpu_irq_restore(flags);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// timer callbacks
+
+// the clock timer interrupt, see init_clock_tc()
+static void clock_tick_callback(void) {
     if (!hw_state.clock_external) {
         hw_state.clock_phase = !hw_state.clock_phase;
         app_clock(&state, hw_state.clock_phase);
     }
+    else {
+        clock_follow_tick();
+    }
 }
 
 static void keyTimer_callback(void* o) {
     event_t e = { .type = kEventKeyTimer, .data = 0 };
-    event_post(&e);
+    post_event(&e);
 }
 
 static void adcTimer_callback(void* o) {
     event_t e = { .type = kEventPollADC, .data = 0 };
-    event_post(&e);
+    post_event(&e);
 }
 
 static void monome_poll_timer_callback(void* obj) {
@@ -234,7 +416,7 @@ static void monome_poll_timer_callback(void* obj) {
 static void monome_refresh_timer_callback(void* obj) {
     if (app_grid_is_dirty(&state)) {
         event_t e = { .type = kEventMonomeRefresh, e.data = 0 };
-        event_post(&e);
+        post_event(&e);
     }
 }
 
@@ -263,18 +445,62 @@ static void handler_MonomeRefresh(int32_t data) {
     app_refresh(&state);
 }
 
+// clock knob to internal clock half period, 500ms - 12ms, as 12500ms / (i +
+// 25) for the 10 bit knob position i, at every 8th position
+static const uint32_t kKnobHalfPeriodUs[129] = {
+    500000, 378788, 304878, 255102, 219298, 192308, 171233, 154321, 140449,
+    128866, 119048, 110619, 103306, 96899, 91241, 86207, 81699, 77640, 73964,
+    70621, 67568, 64767, 62189, 59809, 57604, 55556, 53648, 51867, 50201, 48638,
+    47170, 45788, 44484, 43253, 42088, 40984, 39936, 38941, 37994, 37092, 36232,
+    35411, 34626, 33875, 33156, 32468, 31807, 31172, 30562, 29976, 29412, 28868,
+    28345, 27840, 27352, 26882, 26427, 25988, 25562, 25151, 24752, 24366, 23992,
+    23629, 23277, 22936, 22604, 22282, 21968, 21664, 21368, 21079, 20799, 20525,
+    20259, 20000, 19747, 19501, 19260, 19026, 18797, 18574, 18355, 18142, 17934,
+    17730, 17532, 17337, 17147, 16961, 16779, 16600, 16426, 16255, 16088, 15924,
+    15763, 15605, 15451, 15300, 15152, 15006, 14863, 14723, 14586, 14451, 14318,
+    14188, 14061, 13935, 13812, 13691, 13572, 13455, 13340, 13228, 13116, 13007,
+    12900, 12794, 12690, 12588, 12488, 12389, 12291, 12195, 12101, 12008, 11916
+};
+
+// the knob is filtered with kKnobShift extra bits of resolution, and has to
+// move by kKnobHysteresis before the tempo follows it
+#define kKnobShift 4
+#define kKnobHysteresis (2 << kKnobShift)
+
+// one pole low pass
+static uint16_t knob_filter(uint16_t raw) {
+    int32_t target = (int32_t)raw << kKnobShift;
+    if (hw_state.knob == UINT16_MAX) hw_state.knob = target;
+    hw_state.knob += (target - (int32_t)hw_state.knob) >> 2;
+    return hw_state.knob;
+}
+
+// interpolates the table, no divides
+static uint32_t knob_half_period_us(uint16_t knob) {
+    const uint8_t kFracBits = kKnobShift + 3;  // 8 positions per entry
+    uint16_t idx = knob >> kFracBits;
+    uint32_t frac = knob & ((1 << kFracBits) - 1);
+    uint32_t a = kKnobHalfPeriodUs[idx];
+    uint32_t b = kKnobHalfPeriodUs[idx + 1];
+    return a - (((a - b) * frac) >> kFracBits);
+}
+
 static void handler_PollADC(int32_t data) {
     uint16_t adc[4];
     adc_convert(&adc);
 
     // CLOCK POT INPUT
-    uint16_t i = adc[0] >> 2;
-    if (i != hw_state.clock_prev) {
-        // 500ms - 12ms
-        hw_state.clock_time = 12500 / (i + 25);
-        timer_set(&clockTimer, hw_state.clock_time);
+    uint16_t i = knob_filter(adc[0] >> 2);
+    if (hw_state.clock_external) {
+        clock_follow_set_ratio(i >> kKnobShift);
+    }
+    else if (hw_state.knob_prev == UINT16_MAX ||
+             i > hw_state.knob_prev + kKnobHysteresis ||
+             i + kKnobHysteresis < hw_state.knob_prev) {
+        hw_state.clock_time = knob_half_period_us(i);
+        clock_tc_set_period_us(hw_state.clock_time);
+        hw_state.knob_prev = i;
     }
-    hw_state.clock_prev = i;
 }
 
 static void handler_Front(int32_t data) {
@@ -282,20 +508,23 @@ static void handler_Front(int32_t data) {
         hw_state.front_held_timer = 1;
     }
     else {  // button up
-        if (hw_state.front_held_timer < 15) {
+        if (hw_state.front_chorded) {
+            hw_state.front_chorded = false;
+        }
+        else if (hw_state.front_held_timer < 15) {
             event_t e = { .type = kEventFrontShort, .data = 0 };
-            event_post(&e);
+            post_event(&e);
         }
         else {
             event_t e = { .type = kEventFrontLong, .data = 0 };
-            event_post(&e);
+            post_event(&e);
         }
         hw_state.front_held_timer = 0;
     }
 }
 
 static void handler_KeyTimer(int32_t data) {
-    if (hw_state.front_held_timer >= 1) {
+    if (hw_state.front_held_timer >= 1 && !hw_state.front_chorded) {
         hw_state.front_held_timer++;
     }
 
@@ -306,52 +535,70 @@ static void handler_KeyTimer(int32_t data) {
 
 static void handler_FrontShort(int32_t data) {
     debug_clock_tracking();
+    debug_events();
+    profile_dump();
     app_reset(&state);
 }
 
 static void handler_FrontLong(int32_t data) {
-    flash_write(&state);
+    // written out by store_service() between events, to the current
+    // preset's slot
+    store_save(app_preset_index(&state), &state.preset->patch);
 }
 
 static void handler_ClockNormal(int32_t data) {
+    irqflags_t flags = cpu_irq_save();
+    // the steps the interrupts have already played still count
+    while (hw_state.clock_ext_pending) {
+        hw_state.clock_ext_pending--;
+        app_clock_advance(&state, true);
+    }
     hw_state.clock_external = !gpio_get_pin_value(kClockNormal);
+    hw_state.clock_ext_period = 0;
+    empty_clock_tracking();
+    clock_follow_reset();
+    cpu_irq_restore(flags);
+
+    // pick the knob up again as a tempo or a ratio
+    hw_state.knob_prev = UINT16_MAX;
 }
 
 static void handler_ClockExt(int32_t data) {
-    if (data) {  // only on clock high
-        // TODO: this should be called directly from the interrupt handler
-        save_clock_tracking();
+    // the interrupts have already set the outputs, catch the app up
+    while (hw_state.clock_ext_pending) {
+        // the interrupts look ahead from the app's step by the pending
+        // count, so they have to move together
+        irqflags_t flags = cpu_irq_save();
+        hw_state.clock_ext_pending--;
+        app_clock_advance(&state, true);
+        cpu_irq_restore(flags);
+    }
+
+    if (hw_state.clock_tracking_overflow) {
+        hw_state.clock_tracking_overflow = false;
+        print_dbg("\r\nOVERFLOW:");
+        debug_clock_tracking();
     }
-    app_clock(&state, data);
 }
 
 static void handler_MonomeGridKey(int32_t data) {
     uint8_t x, y, z;
     monome_grid_key_parse_event_data(data, &x, &y, &z);
-    app_grid_press(&state, x, y, z);
-}
 
-static void mp_process_ii(uint8_t* d, uint8_t len) {}
-
-// flash
-static bool flash_empty() {
-    return flash.fresh == 0xFF;
-}
-
-static void flash_read(state_t* s) {
-    if (!flash_empty()) {
-        memcpy(&s->patch, &flash.patch, sizeof(s->patch));
+    // with the front button held, a key in the top row switches to the
+    // preset for its column on the next step, any other row at the next bar
+    if (hw_state.front_held_timer) {
+        if (z) {
+            hw_state.front_chorded = true;
+            app_queue_preset(&state, x, y != 0);
+        }
+        return;
     }
-}
 
-static void flash_write(state_t* s) {
-    flashc_memcpy((void*)&flash.patch, &s->patch, sizeof(s->patch), true);
-
-    if (flash_empty()) {
-        flashc_memset8((void*)&(flash.fresh), 0x00, 1, true);
-    }
+    app_grid_press(&state, x, y, z);
 }
 
+static void mp_process_ii(uint8_t* d, uint8_t len) {}
 
 // assign event handlers
 static void assign_main_event_handlers(void) {
@@ -372,11 +619,106 @@ static void assign_main_event_handlers(void) {
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// event dispatch
+//
+// libavr32 has a single FIFO event queue, so a burst of grid or refresh
+// events could hold up a clock event queued behind them. Each pass of the
+// event loop moves everything waiting into a queue per priority class and
+// then dispatches a bounded batch, highest class first, pulling in new
+// events before each one so that a clock event never waits behind more
+// than the handler already running.
+
+typedef enum {
+    kPriorityClock,
+    kPriorityInput,
+    kPriorityBackground,
+    kNumPriorities
+} priority_t;
+
+// a power of 2, larger than libavr32's queue
+#define kPriorityQueueSize 64
+// events dispatched per pass of the event loop
+#define kEventBatch 8
+
+typedef struct {
+    event_t events[kPriorityQueueSize];
+    uint8_t get;
+    uint8_t count;
+    // instrumentation
+    uint8_t high_water;
+    uint32_t dropped;
+} priority_queue_t;
+
+static priority_queue_t priority_queues[kNumPriorities];
+
+static priority_t event_priority(etype type) {
+    switch (type) {
+        case kEventClockExt:
+        case kEventClockNormal: return kPriorityClock;
+        case kEventFront:
+        case kEventFrontShort:
+        case kEventFrontLong:
+        case kEventKeyTimer:
+        case kEventPollADC:
+        case kEventMonomeGridKey: return kPriorityInput;
+        default: return kPriorityBackground;
+    }
+}
+
+// move everything waiting in the libavr32 queue into the priority queues
+static void pull_events(void) {
+    event_t e;
+    while (event_next(&e)) {
+        priority_queue_t* q = &priority_queues[event_priority(e.type)];
+        if (q->count == kPriorityQueueSize) {
+            q->dropped++;
+            continue;
+        }
+        uint8_t put = (q->get + q->count) & (kPriorityQueueSize - 1);
+        q->events[put] = e;
+        q->count++;
+        if (q->count > q->high_water) q->high_water = q->count;
+    }
+}
+
+static bool next_event(event_t* e) {
+    for (uint8_t p = 0; p < kNumPriorities; p++) {
+        priority_queue_t* q = &priority_queues[p];
+        if (q->count == 0) continue;
+        *e = q->events[q->get];
+        q->get = (q->get + 1) & (kPriorityQueueSize - 1);
+        q->count--;
+        return true;
+    }
+    return false;
+}
+
+static void debug_events(void) {
+    static const char* names[kNumPriorities] = { "clock", "input",
+                                                 "background" };
+    print_dbg("\r\nevents dropped at post: ");
+    print_dbg_ulong(get_events_dropped());
+    for (uint8_t p = 0; p < kNumPriorities; p++) {
+        print_dbg("\r\n");
+        print_dbg(names[p]);
+        print_dbg(": high water ");
+        print_dbg_ulong(priority_queues[p].high_water);
+        print_dbg(", dropped ");
+        print_dbg_ulong(priority_queues[p].dropped);
+    }
+}
+
 // app event loop
 static void check_events(void) {
     event_t e;
-    if (event_next(&e)) {
+    for (uint8_t i = 0; i < kEventBatch; i++) {
+        pull_events();
+        if (!next_event(&e)) return;
+
+        PROFILE_START();
         (app_event_handlers)[e.type](e.data);
+        PROFILE_END(PROFILE_EVENT(e.type));
     }
 }
 
@@ -417,9 +759,17 @@ int main(void) {
     hw_state.clock_external = !gpio_get_pin_value(kClockNormal);
 
     app_init(&state);
-    flash_read(&state);
+    store_init();
+    for (uint8_t i = 0; i < kNumPresets; i++) {
+        patch_t patch;
+        if (store_read(i, &patch)) app_load_preset(&state, i, &patch);
+    }
+
+    // the app is ready for external clock edges
+    clock_pulse = &clock_ext_pulse;
 
-    timer_add(&clockTimer, 120, &clockTimer_callback, NULL);
+    clock_tick = &clock_tick_callback;
+    init_clock_tc(120000);
     timer_add(&keyTimer, 50, &keyTimer_callback, NULL);
     timer_add(&adcTimer, 100, &adcTimer_callback, NULL);
 
@@ -427,5 +777,6 @@ int main(void) {
 
     while (true) {
         check_events();
+        store_service();
     }
 }
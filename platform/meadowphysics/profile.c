@@ -0,0 +1,56 @@
+#include "profile.h"
+
+#ifdef MP_PROFILE
+
+#include "print_funcs.h"
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+} profile_slot_t;
+
+static profile_slot_t slots[kNumProfileSlots];
+
+static const char* irq_names[kNumProfileIrqs] = { "irq_tc", "irq_port0_line1",
+                                                  "irq_port1_line1",
+                                                  "irq_clock_tc" };
+
+void profile_record(uint8_t slot, uint32_t cycles) {
+    profile_slot_t* p = &slots[slot];
+    if (p->count == 0 || cycles < p->min) p->min = cycles;
+    if (cycles > p->max) p->max = cycles;
+    p->total += cycles;
+    p->count++;
+}
+
+void profile_dump(void) {
+    print_dbg("\r\nprofile: count, min, max, mean cycles");
+    for (uint8_t i = 0; i < kNumProfileSlots; i++) {
+        // copy with interrupts off, so interrupt slots aren't torn
+        irqflags_t flags = cpu_irq_save();
+        profile_slot_t p = slots[i];
+        cpu_irq_restore(flags);
+        if (p.count == 0) continue;
+
+        print_dbg("\r\n");
+        if (i < kNumEventTypes) {
+            print_dbg("event ");
+            print_dbg_ulong(i);
+        }
+        else {
+            print_dbg(irq_names[i - kNumEventTypes]);
+        }
+        print_dbg(": ");
+        print_dbg_ulong(p.count);
+        print_dbg(", ");
+        print_dbg_ulong(p.min);
+        print_dbg(", ");
+        print_dbg_ulong(p.max);
+        print_dbg(", ");
+        print_dbg_ulong((uint32_t)(p.total / p.count));
+    }
+}
+
+#endif
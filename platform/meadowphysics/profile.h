@@ -0,0 +1,47 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+// Cycle profiler for the event handlers and interrupts. Keeps the count and
+// the min, max and total Get_sys_count() cycles of each in a static table.
+// Only built with MP_PROFILE defined ('make PROFILE=1'), otherwise every
+// call here compiles away.
+//
+// Handler times include any interrupts that ran during the handler.
+
+#include "compiler.h"
+#include "events.h"
+#include "types.h"
+
+typedef enum {
+    kProfileIrqTc,
+    kProfileIrqPort0Line1,
+    kProfileIrqPort1Line1,
+    kProfileIrqClockTc,
+    kNumProfileIrqs
+} profile_irq_t;
+
+// a slot per event type, followed by a slot per interrupt
+#define kNumProfileSlots (kNumEventTypes + kNumProfileIrqs)
+#define PROFILE_EVENT(type) (type)
+#define PROFILE_IRQ(irq) (kNumEventTypes + (irq))
+
+#ifdef MP_PROFILE
+
+#define PROFILE_START() uint32_t profile_start_ = Get_sys_count()
+#define PROFILE_END(slot) \
+    profile_record((slot), Get_sys_count() - profile_start_)
+
+extern void profile_record(uint8_t slot, uint32_t cycles);
+// print every slot that has run on the debug UART
+extern void profile_dump(void);
+
+#else
+
+#define PROFILE_START()
+#define PROFILE_END(slot)
+
+static inline void profile_dump(void) {}
+
+#endif
+
+#endif
@@ -0,0 +1,289 @@
+#include "store.h"
+
+#include <stddef.h>
+#include <string.h>
+
+// asf
+#include "compiler.h"
+#include "flashc.h"
+
+#define kStorePages 16
+#define kStorePageSize AVR32_FLASHC_PAGE_SIZE
+
+// a power of two, so that a page holds a whole number of records and each
+// record is whole 64 bit words for the page buffer
+#define kRecordSize 64
+
+typedef struct {
+    uint32_t seq;  // one more for every record written, 0xFFFFFFFF if blank
+    uint8_t slot;
+    uint8_t reserved[3];
+    patch_t patch;
+    uint8_t padding[kRecordSize - 3 * sizeof(uint32_t) - sizeof(patch_t)];
+    uint32_t crc;  // CRC-32 of everything before it
+} store_record_t;
+
+#define kRecordsPerPage (kStorePageSize / sizeof(store_record_t))
+#define kBlankSeq 0xFFFFFFFF
+#define kNoPage 0xFF
+
+typedef union {
+    store_record_t records[kRecordsPerPage];
+    uint8_t bytes[kStorePageSize];
+} store_page_t;
+
+// the log, in the NVRAM section of the flash array
+__attribute__((__section__(".flash_nvram"), aligned(kStorePageSize)))
+static const store_page_t pages[kStorePages];
+
+typedef enum {
+    kStoreIdle,
+    kStoreFill,     // page buffer cleared, ready to fill and program
+    kStoreProgram,  // page being programmed
+    kStoreErase,    // page being erased
+} store_op_t;
+
+static struct {
+    store_op_t op;
+    // where the next record goes
+    uint8_t head_page;
+    uint8_t head_record;
+    uint32_t next_seq;
+    // the page after the head, to erase ahead of time once its live records
+    // have been copied forward, kNoPage if there's nothing to erase
+    uint8_t erase_page;
+    // newest record in flash for each slot
+    const store_record_t* saved[kStoreSlots];
+    // saves waiting to be written, bit n for slot n
+    uint8_t pending;
+    patch_t pending_patch[kStoreSlots];
+} store;
+
+static uint8_t next_page(uint8_t page) {
+    return (page + 1) % kStorePages;
+}
+
+// CRC-32 (IEEE), a nibble at a time to keep the table small
+static uint32_t crc32(const uint8_t* data, size_t len) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+        0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+        crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+static bool record_valid(const store_record_t* r) {
+    return r->seq != kBlankSeq && r->slot < kStoreSlots &&
+           r->crc == crc32((const uint8_t*)r, offsetof(store_record_t, crc));
+}
+
+// whether page holds the newest record in flash for any slot, it can't be
+// erased until they have all been written again further on
+static bool page_live(uint8_t page) {
+    const store_record_t* first = pages[page].records;
+    for (uint8_t slot = 0; slot < kStoreSlots; slot++) {
+        const store_record_t* r = store.saved[slot];
+        if (r && r >= first && r < first + kRecordsPerPage) return true;
+    }
+    return false;
+}
+
+static bool page_blank(uint8_t page) {
+    const uint32_t* words = (const uint32_t*)pages[page].bytes;
+    for (size_t i = 0; i < kStorePageSize / sizeof(uint32_t); i++) {
+        if (words[i] != 0xFFFFFFFF) return false;
+    }
+    return true;
+}
+
+// queue a copy of every slot whose newest record is in page, so that the
+// page can be erased
+static void copy_forward(uint8_t page) {
+    for (uint8_t slot = 0; slot < kStoreSlots; slot++) {
+        const store_record_t* r = store.saved[slot];
+        if (!r || (store.pending & (1 << slot))) continue;
+        const store_record_t* first = pages[page].records;
+        if (r < first || r >= first + kRecordsPerPage) continue;
+        store.pending_patch[slot] = r->patch;
+        store.pending |= 1 << slot;
+    }
+}
+
+void store_init(void) {
+    memset(&store, 0, sizeof(store));
+    store.erase_page = kNoPage;
+
+    const store_record_t* newest = NULL;
+    for (uint8_t page = 0; page < kStorePages; page++) {
+        for (uint8_t i = 0; i < kRecordsPerPage; i++) {
+            const store_record_t* r = &pages[page].records[i];
+            if (!record_valid(r)) continue;
+
+            const store_record_t* s = store.saved[r->slot];
+            if (!s || r->seq > s->seq) store.saved[r->slot] = r;
+            if (!newest || r->seq > newest->seq) newest = r;
+        }
+    }
+
+    if (!newest) {
+        // nothing saved yet, pretend the last page is full so that the
+        // first save erases page 0 and starts there, clearing out anything
+        // that isn't a record
+        store.head_page = kStorePages - 1;
+        store.head_record = kRecordsPerPage;
+        store.next_seq = 0;
+        if (!page_blank(0)) store.erase_page = 0;
+        return;
+    }
+
+    // carry on after the last record written to the newest record's page,
+    // a torn write after it still takes up its space
+    uint8_t head_page = (newest - pages[0].records) / kRecordsPerPage;
+    uint8_t head_record = kRecordsPerPage;
+    while (head_record > 0 &&
+           pages[head_page].records[head_record - 1].seq == kBlankSeq) {
+        head_record--;
+    }
+    store.head_page = head_page;
+    store.head_record = head_record;
+    store.next_seq = newest->seq + 1;
+
+    // we may have stopped before the oldest page was erased
+    uint8_t oldest = next_page(head_page);
+    if (!page_blank(oldest)) {
+        store.erase_page = oldest;
+        copy_forward(oldest);
+    }
+}
+
+bool store_read(uint8_t slot, patch_t* patch) {
+    if (slot >= kStoreSlots) return false;
+
+    if (store.pending & (1 << slot)) {
+        *patch = store.pending_patch[slot];
+        return true;
+    }
+    if (store.saved[slot]) {
+        *patch = store.saved[slot]->patch;
+        return true;
+    }
+    return false;
+}
+
+void store_save(uint8_t slot, const patch_t* patch) {
+    if (slot >= kStoreSlots) return;
+    store.pending_patch[slot] = *patch;
+    store.pending |= 1 << slot;
+}
+
+// start a flash command and return straight away, flashc_issue_command()
+// waits for it to finish
+static void issue(uint32_t command, const store_page_t* page) {
+    uint32_t page_number =
+        ((uint32_t)page - AVR32_FLASH_ADDRESS) / kStorePageSize;
+    AVR32_FLASHC.fcmd =
+        (AVR32_FLASHC_FCMD_KEY_KEY << AVR32_FLASHC_FCMD_KEY_OFFSET) |
+        ((page_number << AVR32_FLASHC_FCMD_PAGEN_OFFSET) &
+         AVR32_FLASHC_FCMD_PAGEN_MASK) |
+        (command << AVR32_FLASHC_FCMD_CMD_OFFSET);
+}
+
+static void erase(uint8_t page) {
+    issue(AVR32_FLASHC_FCMD_CMD_EP, &pages[page]);
+    store.op = kStoreErase;
+}
+
+// fill the page buffer with every waiting save that fits in the head page
+// and program it
+static void program(void) {
+    const store_record_t* head = &pages[store.head_page].records[0];
+    uint8_t slots = 0;
+
+    for (uint8_t slot = 0; slot < kStoreSlots; slot++) {
+        if (!(store.pending & (1 << slot))) continue;
+        if (store.head_record == kRecordsPerPage) break;
+
+        store_record_t r;
+        memset(&r, 0, sizeof(r));
+        r.seq = store.next_seq++;
+        r.slot = slot;
+        r.patch = store.pending_patch[slot];
+        r.crc = crc32((const uint8_t*)&r, offsetof(store_record_t, crc));
+
+        // writes into the flash array go to the page buffer, 64 bits at a
+        // time
+        volatile uint64_t* dst =
+            (volatile uint64_t*)&head[store.head_record];
+        const uint64_t* src = (const uint64_t*)&r;
+        for (size_t i = 0; i < sizeof(r) / sizeof(uint64_t); i++) {
+            dst[i] = src[i];
+        }
+
+        store.saved[slot] = &head[store.head_record];
+        store.head_record++;
+        slots |= 1 << slot;
+    }
+
+    store.pending &= ~slots;
+
+    issue(AVR32_FLASHC_FCMD_CMD_WP, &pages[store.head_page]);
+    store.op = kStoreProgram;
+}
+
+bool store_service(void) {
+    // a command is still running
+    if (!flashc_is_ready()) return true;
+
+    switch (store.op) {
+        case kStoreIdle: break;
+        case kStoreFill: program(); return true;
+        case kStoreProgram: break;
+        case kStoreErase: break;
+    }
+    store.op = kStoreIdle;
+
+    if (store.head_record == kRecordsPerPage && store.pending) {
+        // the next page that holds nothing live, normally the one after the
+        // head, but after a torn write the copies from the oldest page may
+        // not all have made it, and then it has to be skipped over
+        uint8_t spare = next_page(store.head_page);
+        while (page_live(spare)) spare = next_page(spare);
+        if (!page_blank(spare)) {
+            if (store.erase_page == spare) store.erase_page = kNoPage;
+            erase(spare);
+            return true;
+        }
+
+        // move into the spare page, and start clearing out the one after it
+        store.head_page = spare;
+        store.head_record = 0;
+        store.erase_page = next_page(spare);
+        copy_forward(store.erase_page);
+    }
+
+    if (store.pending) {
+        issue(AVR32_FLASHC_FCMD_CMD_CPB, &pages[store.head_page]);
+        store.op = kStoreFill;
+        return true;
+    }
+
+    if (store.erase_page != kNoPage) {
+        // everything live in it has been copied forward
+        uint8_t page = store.erase_page;
+        store.erase_page = kNoPage;
+        // already blank the first time round, no need to wear it
+        if (!page_blank(page)) {
+            erase(page);
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,27 @@
+#ifndef _STORE_H_
+#define _STORE_H_
+
+#include "types.h"
+
+#include "app.h"
+
+// Patch storage in flash. Patches are saved to numbered slots as an append
+// only log of CRC-checked records, spread over kStorePages pages so that
+// every page wears at the same rate. Saves are queued in RAM and
+// store_service() issues at most one flash command per call without waiting
+// for it to finish, so saving never stalls the event loop.
+
+// a slot for each preset in the app's bank
+#define kStoreSlots kNumPresets
+
+// find the newest valid record for every slot, once at boot
+extern void store_init(void);
+// the newest patch saved to slot, including queued saves, false if the slot
+// has never been saved
+extern bool store_read(uint8_t slot, patch_t* patch);
+// queue a save, replacing any save to the same slot still waiting
+extern void store_save(uint8_t slot, const patch_t* patch);
+// move any saving along, call between events, true while there is work left
+extern bool store_service(void);
+
+#endif
@@ -0,0 +1,214 @@
+// Microbenchmarks for the app core, linked against a no-op hardware.h.
+//
+// Prints one CSV line per benchmark and patch:
+//   benchmark,patch,iterations,ns_per_op,cycles_per_op
+// cycles_per_op is -1 where there is no cycle counter.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER 1
+#endif
+
+#include "app.h"
+#include "hardware.h"
+
+// hardware.h
+
+#define UNUSED __attribute__((unused))
+
+void hardware_set_outputs(UNUSED uint8_t trigger_mask, UNUSED bool clock) {}
+uint32_t hardware_irq_save(void) {
+    return 0;
+}
+void hardware_irq_restore(UNUSED uint32_t flags) {}
+void grid_set_dirty(UNUSED uint8_t quadrant) {}
+void grid_arc_clear(void) {}
+void grid_set(UNUSED uint8_t x, UNUSED uint8_t y, UNUSED uint8_t level) {}
+void grid_copy_rows(UNUSED uint8_t y, UNUSED uint8_t rows,
+                    UNUSED const uint8_t *levels) {}
+void grid_refresh(void) {}
+
+// patches
+
+typedef struct {
+    const char *name;
+    void (*fill)(patch_t *p);
+} bench_patch_t;
+
+static void fill_empty(patch_t *p) {
+    memset(p, 0, sizeof(patch_t));
+}
+
+static void fill_full(patch_t *p) {
+    for (uint8_t row = 0; row < kNumRows; row++) p->rows[row] = UINT16_MAX;
+}
+
+static void fill_random(patch_t *p) {
+    // fixed seed so every run benchmarks the same patch
+    uint32_t seed = 0x12345678;
+    for (uint8_t row = 0; row < kNumRows; row++) {
+        seed = seed * 1664525 + 1013904223;  // LCG
+        p->rows[row] = (row_t)(seed >> 16);
+    }
+}
+
+static void fill_polymetric(patch_t *p) {
+    // every row a different length, rate and direction
+    fill_random(p);
+    for (uint8_t row = 0; row < kNumRows; row++) {
+        p->config[row].length = (uint8_t)(kNumSteps - row * 2 + 1);
+        p->config[row].divisor = (uint8_t)(row % 4 + 1);
+        p->config[row].direction = (uint8_t)(row % kNumDirections);
+    }
+}
+
+static const bench_patch_t patches[] = { { "empty", fill_empty },
+                                          { "full", fill_full },
+                                          { "random", fill_random },
+                                          { "polymetric", fill_polymetric } };
+
+// benchmarks
+
+typedef struct {
+    const char *name;
+    void (*run)(state_t *s, uint32_t i);
+    // work run needs to do each time but that isn't being measured, timed
+    // on its own and taken off run's time, or NULL
+    void (*setup)(state_t *s, uint32_t i);
+} bench_t;
+
+static void run_clock_rise(state_t *s, UNUSED uint32_t i) {
+    app_clock(s, true);
+}
+
+static void run_clock_fall(state_t *s, UNUSED uint32_t i) {
+    app_clock(s, false);
+}
+
+static volatile uint8_t triggers_sink;
+static void run_triggers_ahead(state_t *s, UNUSED uint32_t i) {
+    // the module's clock interrupts look one step ahead of the app unless
+    // the event loop falls behind
+    triggers_sink = app_triggers_ahead(s, 1);
+}
+
+static void run_clock(state_t *s, uint32_t i) {
+    app_clock(s, i & 1);
+}
+
+static void run_refresh(state_t *s, uint32_t i) {
+    // with the clock moving there are playheads to draw every time
+    run_clock(s, i);
+    app_refresh(s);
+}
+
+static void run_grid_press(state_t *s, uint32_t i) {
+    // walk the whole grid, every key down toggles a step
+    uint8_t x = (uint8_t)(i % kNumSteps);
+    uint8_t y = (uint8_t)((i / kNumSteps) % kNumRows);
+    app_grid_press(s, x, y, (uint8_t)(i & 1));
+}
+
+static volatile bool dirty_sink;
+static void run_grid_is_dirty(state_t *s, UNUSED uint32_t i) {
+    dirty_sink = app_grid_is_dirty(s);
+}
+
+static const bench_t benches[] = {
+    { "app_clock_rise", run_clock_rise, NULL },
+    { "app_clock_fall", run_clock_fall, NULL },
+    { "app_triggers_ahead", run_triggers_ahead, NULL },
+    { "app_refresh", run_refresh, run_clock },
+    { "app_grid_press", run_grid_press, NULL },
+    { "app_grid_is_dirty", run_grid_is_dirty, NULL }
+};
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t now_cycles(void) {
+#ifdef HAVE_CYCLE_COUNTER
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// time iterations calls of run on a fresh state playing the patch
+static void time_run(void (*run)(state_t *s, uint32_t i),
+                     const bench_patch_t *p, uint32_t iterations,
+                     int64_t *ns, int64_t *cycles) {
+    static state_t state;
+    patch_t patch;
+
+    app_init(&state);
+    memset(&patch, 0, sizeof(patch));
+    p->fill(&patch);
+    app_load_patch(&state, &patch);
+
+    // warm up
+    for (uint32_t i = 0; i < iterations / 10; i++) run(&state, i);
+
+    uint64_t start_ns = now_ns();
+    uint64_t start_cycles = now_cycles();
+    for (uint32_t i = 0; i < iterations; i++) run(&state, i);
+    *cycles = (int64_t)(now_cycles() - start_cycles);
+    *ns = (int64_t)(now_ns() - start_ns);
+}
+
+static void run_bench(const bench_t *b, const bench_patch_t *p,
+                      uint32_t iterations) {
+    int64_t ns, cycles;
+    time_run(b->run, p, iterations, &ns, &cycles);
+    if (b->setup) {
+        int64_t setup_ns, setup_cycles;
+        time_run(b->setup, p, iterations, &setup_ns, &setup_cycles);
+        ns -= setup_ns;
+        cycles -= setup_cycles;
+    }
+
+    double cycles_per_op = -1;
+#ifdef HAVE_CYCLE_COUNTER
+    cycles_per_op = (double)cycles / iterations;
+#endif
+    printf("%s,%s,%u,%.2f,%.2f\n", b->name, p->name, iterations,
+           (double)ns / iterations, cycles_per_op);
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t iterations = 1000000;
+    const char *only = NULL;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:b:h")) != -1) {
+        switch (c) {
+            case 'n': iterations = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'b': only = optarg; break;
+            default:
+                printf("usage: %s [-n iterations] [-b benchmark]\n", argv[0]);
+                return -1;
+        }
+    }
+    if (iterations == 0) iterations = 1;
+
+    printf("benchmark,patch,iterations,ns_per_op,cycles_per_op\n");
+    for (size_t b = 0; b < ARRAY_LEN(benches); b++) {
+        if (only && strcmp(only, benches[b].name) != 0) continue;
+        for (size_t p = 0; p < ARRAY_LEN(patches); p++) {
+            run_bench(&benches[b], &patches[p], iterations);
+        }
+    }
+
+    return 0;
+}
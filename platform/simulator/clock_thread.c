@@ -0,0 +1,171 @@
+#define _GNU_SOURCE  // pthread_setaffinity_np
+
+#include "clock_thread.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "timespec.h"
+
+#define NSEC_PER_SEC 1000000000
+
+static pthread_t thread;
+static bool running = false;
+static atomic_bool stop_now = false;
+static _Atomic int64_t period_ns = 0;
+
+static struct timespec service_interval;
+static void (*tick_callback)(void);
+static void (*service_callback)(void);
+
+// instrumentation, only written by the clock thread
+static histogram_t tick_lateness;
+static histogram_t tick_duration;
+static histogram_t service_duration;
+static _Atomic uint64_t ticks_missed = 0;
+
+static int64_t to_ns(struct timespec ts) {
+    return (int64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static struct timespec from_ns(int64_t ns) {
+    struct timespec ts = { .tv_sec = ns / NSEC_PER_SEC,
+                           .tv_nsec = ns % NSEC_PER_SEC };
+    return ts;
+}
+
+static struct timespec now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts;
+}
+
+// returns the time actually woken up at
+static struct timespec sleep_until(struct timespec when) {
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) ==
+           EINTR) {
+    }
+    return now();
+}
+
+static void *clock_thread(void *arg) {
+    (void)arg;
+
+    struct timespec next = now();
+    struct timespec service_next = next;
+
+    while (!atomic_load(&stop_now)) {
+        bool tick_due = !timespec_gt(next, service_next);
+        struct timespec woke = sleep_until(tick_due ? next : service_next);
+
+        if (tick_due) {
+            histogram_record(&tick_lateness, to_ns(timespec_sub(woke, next)));
+
+            (*tick_callback)();
+
+            struct timespec done = now();
+            histogram_record(&tick_duration, to_ns(timespec_sub(done, woke)));
+
+            // absolute deadlines, lateness doesn't accumulate
+            next = timespec_add(next, from_ns(atomic_load(&period_ns)));
+            if (timespec_le(next, done)) {
+                // already late for the next tick, it will fire straight away
+                atomic_store_explicit(&ticks_missed, ticks_missed + 1,
+                                      memory_order_relaxed);
+            }
+        }
+        else {
+            (*service_callback)();
+
+            struct timespec done = now();
+            histogram_record(&service_duration,
+                             to_ns(timespec_sub(done, woke)));
+
+            service_next = timespec_add(service_next, service_interval);
+            // don't try to catch up on service calls
+            if (timespec_lt(service_next, done)) {
+                service_next = timespec_add(done, service_interval);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void apply_options(const clock_thread_options_t *options) {
+    if (options->priority > 0) {
+        struct sched_param param = { .sched_priority = options->priority };
+        int err = pthread_setschedparam(thread, SCHED_FIFO, &param);
+        if (err) {
+            printf("Clock thread: could not use SCHED_FIFO priority %d (%s), "
+                   "using the default scheduler\n",
+                   options->priority, strerror(err));
+        }
+    }
+
+    if (options->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET((size_t)options->cpu, &cpus);
+        int err = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+        if (err) {
+            printf("Clock thread: could not pin to CPU %d (%s)\n",
+                   options->cpu, strerror(err));
+        }
+    }
+}
+
+bool clock_thread_start(struct timespec period, struct timespec service_every,
+                        void (*tick)(void), void (*service)(void),
+                        const clock_thread_options_t *options) {
+    if (running) return false;
+
+    atomic_store(&period_ns, to_ns(period));
+    atomic_store(&stop_now, false);
+    service_interval = service_every;
+    tick_callback = tick;
+    service_callback = service;
+
+    // signals are for the main thread, the new thread inherits this mask
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int err = pthread_create(&thread, NULL, clock_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err) {
+        printf("Clock thread: could not start (%s)\n", strerror(err));
+        return false;
+    }
+
+    running = true;
+    apply_options(options);
+    return true;
+}
+
+void clock_thread_stop(void) {
+    if (!running) return;
+
+    atomic_store(&stop_now, true);
+    pthread_join(thread, NULL);
+    running = false;
+}
+
+void clock_thread_set_period(struct timespec period) {
+    atomic_store(&period_ns, to_ns(period));
+}
+
+void clock_thread_print_stats(FILE *f) {
+    fprintf(f, "clock thread: %lu missed ticks\n",
+            (unsigned long)atomic_load(&ticks_missed));
+    histogram_print(&tick_lateness, "tick lateness", f);
+    histogram_print(&tick_duration, "tick duration", f);
+    histogram_print(&service_duration, "service duration", f);
+}
@@ -0,0 +1,30 @@
+#ifndef _CLOCK_THREAD_H_
+#define _CLOCK_THREAD_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+// Runs the clock on a dedicated thread sleeping on absolute deadlines, so
+// that grid and terminal I/O on the main thread can't delay clock edges.
+
+typedef struct {
+    int priority;  // SCHED_FIFO priority, 0 to keep the default scheduler
+    int cpu;       // CPU to pin the thread to, -1 for any
+} clock_thread_options_t;
+
+// call tick() every period, and service() at least every service_every in
+// between, both on the clock thread
+bool clock_thread_start(struct timespec period, struct timespec service_every,
+                        void (*tick)(void), void (*service)(void),
+                        const clock_thread_options_t *options);
+void clock_thread_stop(void);
+
+// can be called from any thread, takes effect from the next tick
+void clock_thread_set_period(struct timespec period);
+
+// dump the tick lateness and callback duration histograms, can be called
+// from any thread
+void clock_thread_print_stats(FILE *f);
+
+#endif
@@ -1,26 +1,135 @@
 #include "csound.h"
 
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <csound/csound.h>
 
 #include "orchestras.h"
+#include "ring.h"
 
-static bool quit_csound_now = false;
+#define NSEC_PER_SEC 1000000000
+
+// how far behind the clock edge notes start on top of one perform call,
+// the time until the Csound thread next drains the trigger queue
+#define kTriggerLatencyNs (2 * 1000000)
+
+const csound_options_t kCsoundDefault = { .ksmps = 10,
+                                          .buffer = 256,
+                                          .hw_buffer = 1024 };
+const csound_options_t kCsoundLowLatency = { .ksmps = 16,
+                                             .buffer = 64,
+                                             .hw_buffer = 256 };
+const csound_options_t kCsoundLowCpu = { .ksmps = 64,
+                                         .buffer = 1024,
+                                         .hw_buffer = 4096 };
+
+static atomic_bool quit_csound_now = false;
 static void *cs_thread_id;
 
+// trigger changes waiting for the Csound thread, stamped with the time of
+// the clock edge that caused them
+typedef struct {
+    int64_t at;  // CLOCK_MONOTONIC ns
+    uint8_t on;
+    uint8_t off;
+} trigger_event_t;
+
+static ring_t trigger_events;
+static atomic_uint triggers_dropped = 0;
+
 // Csound thread
 typedef struct {
     CSOUND *csound;
+    // estimate of the monotonic time at which audio sample 0 was rendered
+    int64_t sample_zero;
+    bool sample_zero_set;
+    int64_t latency;  // ns
 } cs_user_data_t;
 cs_user_data_t cs_user_data = {};
 
+// p-fields to start and stop the note for each output, precomputed so that
+// triggers don't need any score text building or parsing
+// "i 1.1 0 -1 9.00" (held until turned off)
+static const MYFLT note_on[8][4] = {
+    { 1.1, 0, -1, 9.00 }, { 1.2, 0, -1, 9.02 }, { 1.3, 0, -1, 9.04 },
+    { 1.4, 0, -1, 9.05 }, { 1.5, 0, -1, 9.07 }, { 1.6, 0, -1, 9.09 },
+    { 1.7, 0, -1, 9.11 }, { 1.8, 0, -1, 10.00 }
+};
+// "i -1.1 0 0"
+static const MYFLT note_off[8][3] = { { -1.1, 0, 0 }, { -1.2, 0, 0 },
+                                      { -1.3, 0, 0 }, { -1.4, 0, 0 },
+                                      { -1.5, 0, 0 }, { -1.6, 0, 0 },
+                                      { -1.7, 0, 0 }, { -1.8, 0, 0 } };
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// keep the mapping from monotonic time to sample time up to date, it
+// follows slowly so that jitter in when this thread runs doesn't show up
+static void track_sample_zero(cs_user_data_t *ud, double sr) {
+    int64_t samples = csoundGetCurrentTimeSamples(ud->csound);
+    int64_t zero = now_ns() - (int64_t)((double)samples * NSEC_PER_SEC / sr);
+    if (!ud->sample_zero_set) {
+        ud->sample_zero = zero;
+        ud->sample_zero_set = true;
+    }
+    else {
+        ud->sample_zero += (zero - ud->sample_zero) / 64;
+    }
+}
+
+void csound_score_triggers(CSOUND *csound, double start, uint8_t on,
+                           uint8_t off) {
+    for (uint8_t idx = 0; idx < 8; idx++) {
+        if (on & (1 << idx)) {
+            MYFLT p[4];
+            memcpy(p, note_on[idx], sizeof(p));
+            p[1] = (MYFLT)start;
+            csoundScoreEvent(csound, 'i', p, 4);
+        }
+        else if (off & (1 << idx)) {
+            MYFLT p[3];
+            memcpy(p, note_off[idx], sizeof(p));
+            p[1] = (MYFLT)start;
+            csoundScoreEvent(csound, 'i', p, 3);
+        }
+    }
+}
+
+// start each queued note at the sample its clock edge maps to
+static void drain_trigger_events(cs_user_data_t *ud, double sr) {
+    int64_t current = csoundGetCurrentTimeSamples(ud->csound);
+
+    trigger_event_t e;
+    while (ring_pop(&trigger_events, &e)) {
+        int64_t at = e.at + ud->latency - ud->sample_zero;
+        int64_t offset = (int64_t)((double)at * sr / NSEC_PER_SEC) - current;
+        // too late to be on time, start as soon as possible
+        if (offset < 0) offset = 0;
+        csound_score_triggers(ud->csound, (double)offset / sr, e.on, e.off);
+    }
+}
+
 static uintptr_t cs_thread(void *data) {
     cs_user_data_t *ud = (cs_user_data_t *)data;
-    while ((csoundPerformKsmps(ud->csound) == 0) &&
-           (quit_csound_now == false)) {
-    }
-    csoundDestroy(ud->csound);
+    double sr = csoundGetSr(ud->csound);
+    // a whole buffer per call, Csound blocks writing it to the sound card
+    // so this sleeps rather than spins while the card plays the last one
+    do {
+        track_sample_zero(ud, sr);
+        drain_trigger_events(ud, sr);
+    } while ((csoundPerformBuffer(ud->csound) == 0) &&
+             !atomic_load(&quit_csound_now));
     return 1;
 }
 
@@ -33,46 +142,87 @@ static void no_message_callback(__attribute__((unused)) CSOUND *cs,
     return;
 }
 
-void start_csound() {
-    // Csound set up
+bool csound_preset(const char *name, csound_options_t *options) {
+    if (strcmp(name, "default") == 0) {
+        *options = kCsoundDefault;
+    }
+    else if (strcmp(name, "low-latency") == 0) {
+        *options = kCsoundLowLatency;
+    }
+    else if (strcmp(name, "low-cpu") == 0) {
+        *options = kCsoundLowCpu;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+static void set_option_int(CSOUND *csound, const char *name, int value) {
+    char option[32];
+    snprintf(option, sizeof(option), "%s%d", name, value);
+    csoundSetOption(csound, option);
+}
+
+static void initialize_csound(void) {
     // silence Csound messages
     csoundSetDefaultMessageCallback(no_message_callback);
     csoundInitialize(CSOUNDINIT_NO_ATEXIT | CSOUNDINIT_NO_SIGNAL_HANDLER);
-    cs_user_data.csound = csoundCreate(NULL);
+}
+
+CSOUND *create_csound(const csound_options_t *options, const char *output) {
+    static pthread_once_t initialized = PTHREAD_ONCE_INIT;
+    pthread_once(&initialized, initialize_csound);
 
-    csoundSetOption(cs_user_data.csound, "-odac");
-    csoundSetOption(cs_user_data.csound, "-d");
-    if (csoundCompileOrc(cs_user_data.csound, simple_trigger_orc) != 0) {
+    CSOUND *csound = csoundCreate(NULL);
+    char option[PATH_MAX + 4];
+    snprintf(option, sizeof(option), "-o%s", output);
+    csoundSetOption(csound, option);
+    csoundSetOption(csound, "-d");
+    // honour the start offsets of trigger events within a ksmps block
+    csoundSetOption(csound, "--sample-accurate");
+    // overrides the orchestra header
+    set_option_int(csound, "--ksmps=", options->ksmps);
+    set_option_int(csound, "-b", options->buffer);
+    set_option_int(csound, "-B", options->hw_buffer);
+    if (csoundCompileOrc(csound, simple_trigger_orc) != 0) {
+        csoundDestroy(csound);
+        return NULL;
+    }
+    return csound;
+}
+
+void start_csound(const csound_options_t *options) {
+    cs_user_data.csound = create_csound(options, "dac");
+    if (!cs_user_data.csound) {
         printf("Orchestra compile failed\n");
         exit(-1);
     }
     csoundStart(cs_user_data.csound);
+
+    cs_user_data.latency =
+        (int64_t)((double)options->buffer * NSEC_PER_SEC /
+                  csoundGetSr(cs_user_data.csound)) +
+        kTriggerLatencyNs;
+
+    if (!ring_init(&trigger_events, sizeof(trigger_event_t), 1024)) exit(-1);
     cs_thread_id = csoundCreateThread(cs_thread, &cs_user_data);
 }
 
 void stop_csound() {
-    quit_csound_now = true;
+    atomic_store(&quit_csound_now, true);
     csoundJoinThread(cs_thread_id);
     csoundDestroy(cs_user_data.csound);
+    cs_user_data.csound = NULL;
+    ring_free(&trigger_events);
+
+    unsigned int dropped = atomic_load(&triggers_dropped);
+    if (dropped) printf("Csound: %u trigger events dropped\n", dropped);
 }
 
-void csound_set_trigger_output(uint8_t idx, bool state) {
-    const char *i[] = { "1", "2", "3", "4", "5", "6", "7", "8" };
-    const char *const n[] = { "9.00", "9.02", "9.04", "9.05",
-                              "9.07", "9.09", "9.11", "10.00" };
-    if (state) {
-        // "i 1.1 0 -1 9.04"
-        char m[255] = "i 1.";
-        strcat(m, i[idx]);
-        strcat(m, " 0 -1 ");
-        strcat(m, n[idx]);
-        csoundInputMessageAsync(cs_user_data.csound, m);
-    }
-    else {
-        // "i -1.1 0 0"
-        char m[255] = "i -1.";
-        strcat(m, i[idx]);
-        strcat(m, " 0 0");
-        csoundInputMessageAsync(cs_user_data.csound, m);
-    }
+void csound_set_trigger_outputs(uint8_t on, uint8_t off) {
+    if (!cs_user_data.csound) return;  // not started
+
+    trigger_event_t e = { .at = now_ns(), .on = on, .off = off };
+    if (!ring_push(&trigger_events, &e)) atomic_fetch_add(&triggers_dropped, 1);
 }
@@ -4,8 +4,41 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-void start_csound(void);
+// how Csound is run, trading latency for CPU. Csound renders buffer
+// samples per perform call in blocks of ksmps and keeps hw_buffer samples
+// queued on the sound card.
+typedef struct {
+    int ksmps;
+    int buffer;     // -b
+    int hw_buffer;  // -B
+} csound_options_t;
+
+// the orchestra's ksmps with Csound's usual buffers, ~5ms per call
+extern const csound_options_t kCsoundDefault;
+// short buffers for playing along, ~1.3ms per call, expect underruns on a
+// loaded machine
+extern const csound_options_t kCsoundLowLatency;
+// long buffers and large blocks, ~21ms per call, for when triggers landing
+// late doesn't matter
+extern const csound_options_t kCsoundLowCpu;
+
+// look up a preset by name ("default", "low-latency" or "low-cpu")
+bool csound_preset(const char *name, csound_options_t *options);
+
+typedef struct CSOUND_ CSOUND;
+
+// a Csound instance with the trigger orchestra compiled, not yet started,
+// writing to output ("dac" for the sound card, or a file path), NULL if the
+// orchestra doesn't compile. Safe to call from any thread.
+CSOUND *create_csound(const csound_options_t *options, const char *output);
+// schedule the notes for the outputs set in on to start, and those set in
+// off to stop, start seconds after csound's current time
+void csound_score_triggers(CSOUND *csound, double start, uint8_t on,
+                           uint8_t off);
+
+void start_csound(const csound_options_t *options);
 void stop_csound(void);
-void csound_set_trigger_output(uint8_t idx, bool state);
+// start notes for the outputs set in on, stop those set in off
+void csound_set_trigger_outputs(uint8_t on, uint8_t off);
 
 #endif
@@ -0,0 +1,73 @@
+#include "histogram.h"
+
+static void add(_Atomic uint64_t *v, uint64_t n) {
+    // single writer, so a plain load and store is enough
+    uint64_t old = atomic_load_explicit(v, memory_order_relaxed);
+    atomic_store_explicit(v, old + n, memory_order_relaxed);
+}
+
+static uint8_t bucket(uint64_t ns) {
+    uint8_t b = 0;
+    while (ns && b < HISTOGRAM_BUCKETS - 1) {
+        ns >>= 1;
+        b++;
+    }
+    return b;
+}
+
+void histogram_record(histogram_t *h, int64_t ns) {
+    uint64_t v = ns > 0 ? (uint64_t)ns : 0;
+
+    add(&h->buckets[bucket(v)], 1);
+    add(&h->count, 1);
+    add(&h->total, v);
+    if (v > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, v, memory_order_relaxed);
+    }
+}
+
+static void print_ns(uint64_t ns, FILE *f) {
+    if (ns < 1000) {
+        fprintf(f, "%6luns", (unsigned long)ns);
+    }
+    else if (ns < 1000000) {
+        fprintf(f, "%6.1fus", (double)ns / 1e3);
+    }
+    else if (ns < 1000000000) {
+        fprintf(f, "%6.1fms", (double)ns / 1e6);
+    }
+    else {
+        fprintf(f, "%6.1fs ", (double)ns / 1e9);
+    }
+}
+
+void histogram_print(histogram_t *h, const char *name, FILE *f) {
+    uint64_t count = atomic_load(&h->count);
+    uint64_t total = atomic_load(&h->total);
+
+    fprintf(f, "  %s: %lu samples, mean ", name, (unsigned long)count);
+    print_ns(count ? total / count : 0, f);
+    fprintf(f, ", max ");
+    print_ns(atomic_load(&h->max), f);
+    fprintf(f, "\n");
+
+    for (uint8_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        uint64_t n = atomic_load(&h->buckets[b]);
+        if (n == 0) continue;
+
+        fprintf(f, "    ");
+        if (b == 0) {
+            fprintf(f, "        0 ");
+        }
+        else if (b == HISTOGRAM_BUCKETS - 1) {
+            fprintf(f, ">=");
+            print_ns((uint64_t)1 << (b - 1), f);
+        }
+        else {
+            fprintf(f, "<");
+            print_ns((uint64_t)1 << b, f);
+            fprintf(f, " ");
+        }
+        fprintf(f, "%10lu\n", (unsigned long)n);
+    }
+}
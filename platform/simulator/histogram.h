@@ -0,0 +1,27 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Fixed size log2 histogram of nanosecond durations. Recording never
+// allocates or locks. There must be a single writer, but any thread may
+// print at the same time.
+
+// bucket 0 counts 0ns, bucket n counts [2^(n-1), 2^n) ns, the last bucket
+// also counts everything above it (2^38ns is about 4.5 minutes)
+#define HISTOGRAM_BUCKETS 40
+
+typedef struct {
+    _Atomic uint64_t buckets[HISTOGRAM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t total;
+    _Atomic uint64_t max;
+} histogram_t;
+
+void histogram_record(histogram_t *h, int64_t ns);
+// prints count, mean and max, then a line per non-empty bucket
+void histogram_print(histogram_t *h, const char *name, FILE *f);
+
+#endif
@@ -0,0 +1,193 @@
+#include "render.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <csound/csound.h>
+
+#include "timespec.h"
+
+// keep rendering after the last tick so that released notes can ring out
+#define kTailSeconds 1.0
+
+typedef struct {
+    CSOUND *csound;
+    double sr;
+    int64_t tick_sample;  // the sample the current clock tick lands on
+    uint8_t playing;      // outputs with a note held
+} render_t;
+
+// the render running on this thread, if any
+static _Thread_local render_t *current = NULL;
+
+typedef struct {
+    render_job_t *jobs;
+    size_t count;
+    atomic_size_t next;  // next job to hand out
+    uint32_t ticks;
+    struct timespec period;
+    const csound_options_t *options;
+} render_queue_t;
+
+bool render_read_patch(const char *path, patch_t *patch) {
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+
+    memset(patch, 0, sizeof(patch_t));
+
+    char line[256];
+    uint8_t row = 0;
+    while (row < kNumRows && fgets(line, sizeof(line), f)) {
+        size_t len = strcspn(line, "\r\n");
+        if (len == 0 || line[0] == '#') continue;
+
+        size_t steps = strcspn(line, " \t\r\n");
+        for (uint8_t step = 0; step < kNumSteps && step < steps; step++) {
+            if (line[step] != '.') patch->rows[row] |= (row_t)(1 << step);
+        }
+
+        // anything left out keeps the default, see row_config_t
+        unsigned int length = 0, divisor = 0;
+        char direction[3] = "";
+        sscanf(line + steps, "%u %u %2s", &length, &divisor, direction);
+        row_config_t *config = &patch->config[row];
+        config->length = (uint8_t)(length <= kNumSteps ? length : 0);
+        config->divisor = (uint8_t)(divisor <= UINT8_MAX ? divisor : 0);
+        if (strcmp(direction, "<") == 0) {
+            config->direction = kReverse;
+        }
+        else if (strcmp(direction, "<>") == 0) {
+            config->direction = kPingPong;
+        }
+        row++;
+    }
+
+    fclose(f);
+    return true;
+}
+
+bool render_set_outputs(uint8_t trigger_mask,
+                        __attribute__((unused)) bool clock) {
+    render_t *r = current;
+    if (!r) return false;
+
+    uint8_t on = trigger_mask & ~r->playing;
+    uint8_t off = r->playing & ~trigger_mask;
+    if (on || off) {
+        // always ahead of Csound, see perform_until()
+        int64_t offset =
+            r->tick_sample - csoundGetCurrentTimeSamples(r->csound);
+        csound_score_triggers(r->csound, (double)offset / r->sr, on, off);
+    }
+    r->playing = trigger_mask;
+    return true;
+}
+
+// perform whole ksmps blocks up to the one that contains sample
+static bool perform_until(render_t *r, int64_t sample) {
+    int64_t ksmps = (int64_t)csoundGetKsmps(r->csound);
+    while (csoundGetCurrentTimeSamples(r->csound) + ksmps <= sample) {
+        if (csoundPerformKsmps(r->csound) != 0) return false;
+    }
+    return true;
+}
+
+static bool render_job(const render_job_t *job, uint32_t ticks,
+                       struct timespec period,
+                       const csound_options_t *options) {
+    patch_t patch;
+    if (!render_read_patch(job->patch, &patch)) {
+        fprintf(stderr, "Could not read patch %s\n", job->patch);
+        return false;
+    }
+
+    state_t state;
+    app_init(&state);
+    app_load_patch(&state, &patch);
+
+    render_t r = { .tick_sample = 0, .playing = 0 };
+    r.csound = create_csound(options, job->output);
+    if (!r.csound) return false;
+    csoundSetOption(r.csound, "-W");  // WAV
+    if (csoundStart(r.csound) != 0) {
+        csoundDestroy(r.csound);
+        return false;
+    }
+    r.sr = csoundGetSr(r.csound);
+    current = &r;
+
+    const double period_samples = timespec_to_double(period) * r.sr;
+    bool ok = true;
+    bool phase = false;  // start clock low, like the simulator
+    for (uint32_t tick = 0; ok && tick <= ticks; tick++) {
+        r.tick_sample = llround((double)tick * period_samples);
+        ok = perform_until(&r, r.tick_sample);
+        if (tick < ticks) {
+            app_clock(&state, phase);
+            phase = !phase;
+        }
+        else {
+            // release anything still held on the tick after the last
+            render_set_outputs(0, false);
+        }
+    }
+    if (ok) {
+        ok = perform_until(&r, r.tick_sample + llround(kTailSeconds * r.sr));
+    }
+
+    current = NULL;
+    csoundCleanup(r.csound);
+    csoundDestroy(r.csound);
+    return ok;
+}
+
+static void *render_thread(void *data) {
+    render_queue_t *q = (render_queue_t *)data;
+    size_t idx;
+    while ((idx = atomic_fetch_add(&q->next, 1)) < q->count) {
+        render_job_t *job = &q->jobs[idx];
+        job->ok = render_job(job, q->ticks, q->period, q->options);
+    }
+    return NULL;
+}
+
+bool render_patches(render_job_t *jobs, size_t count, uint32_t ticks,
+                    struct timespec period, unsigned int threads,
+                    const csound_options_t *options) {
+    render_queue_t q = { .jobs = jobs,
+                         .count = count,
+                         .next = 0,
+                         .ticks = ticks,
+                         .period = period,
+                         .options = options };
+    for (size_t idx = 0; idx < count; idx++) jobs[idx].ok = false;
+
+    if (threads < 1) threads = 1;
+    if (threads > count) threads = (unsigned int)count;
+
+    pthread_t *ids = calloc(threads, sizeof(pthread_t));
+    if (!ids) return false;
+
+    // this thread always renders too, so a failed spawn only costs speed
+    unsigned int started = 0;
+    for (unsigned int t = 1; t < threads; t++) {
+        if (pthread_create(&ids[started], NULL, render_thread, &q) != 0) break;
+        started++;
+    }
+    render_thread(&q);
+    for (unsigned int t = 0; t < started; t++) pthread_join(ids[t], NULL);
+    free(ids);
+
+    bool ok = true;
+    for (size_t idx = 0; idx < count; idx++) {
+        if (!jobs[idx].ok) {
+            fprintf(stderr, "Render of %s failed\n", jobs[idx].patch);
+            ok = false;
+        }
+    }
+    return ok;
+}
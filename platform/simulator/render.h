@@ -0,0 +1,41 @@
+#ifndef _RENDER_H_
+#define _RENDER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "app.h"
+#include "csound.h"
+
+// Offline rendering of patches to WAV files, for regression testing the
+// sound. The clock runs on virtual sequence time and Csound writes to a file
+// as fast as the CPU allows. Every patch gets its own Csound instance and
+// patches are rendered in parallel across threads.
+
+typedef struct {
+    const char *patch;   // patch file to read
+    const char *output;  // WAV file to write
+    bool ok;             // set once the render has finished
+} render_job_t;
+
+// a patch file has one row per line, a '.' for each step that is off and
+// any other character for a step that is on, blank lines and lines starting
+// with '#' are ignored and missing rows or steps are off
+//
+// the steps can be followed by the row's length, clock divisor and
+// direction ('>', '<' or '<>' for ping-pong), e.g. "x..x..x. 6 2 <>"
+bool render_read_patch(const char *path, patch_t *patch);
+
+// play each job's patch for ticks clock ticks, one every period, using up to
+// threads threads, returns false if any job failed
+bool render_patches(render_job_t *jobs, size_t count, uint32_t ticks,
+                    struct timespec period, unsigned int threads,
+                    const csound_options_t *options);
+
+// hardware_set_outputs() for render threads, returns false if the calling
+// thread isn't rendering
+bool render_set_outputs(uint8_t trigger_mask, bool clock);
+
+#endif
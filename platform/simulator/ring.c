@@ -0,0 +1,50 @@
+#include "ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+bool ring_init(ring_t *r, size_t size, size_t capacity) {
+    size_t cap = 1;
+    while (cap < capacity) cap <<= 1;
+
+    r->buf = malloc(size * cap);
+    if (!r->buf) return false;
+
+    r->size = size;
+    r->mask = cap - 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    return true;
+}
+
+void ring_free(ring_t *r) {
+    free(r->buf);
+    r->buf = NULL;
+}
+
+bool ring_push(ring_t *r, const void *elem) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail > r->mask) return false;
+
+    memcpy(r->buf + (head & r->mask) * r->size, elem, r->size);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return true;
+}
+
+bool ring_peek(ring_t *r, void *elem) {
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (head == tail) return false;
+
+    memcpy(elem, r->buf + (tail & r->mask) * r->size, r->size);
+    return true;
+}
+
+bool ring_pop(ring_t *r, void *elem) {
+    if (!ring_peek(r, elem)) return false;
+
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return true;
+}
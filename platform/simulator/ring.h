@@ -0,0 +1,31 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lock-free single producer, single consumer ring buffer of fixed size
+// elements. Only ring_init() and ring_free() allocate.
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;          // bytes per element
+    size_t mask;          // capacity - 1, capacity is a power of 2
+    atomic_size_t head;   // next slot to write, only moved by the producer
+    atomic_size_t tail;   // next slot to read, only moved by the consumer
+} ring_t;
+
+// capacity is rounded up to a power of 2
+bool ring_init(ring_t *r, size_t size, size_t capacity);
+void ring_free(ring_t *r);
+
+// producer side, returns false if the ring is full
+bool ring_push(ring_t *r, const void *elem);
+// consumer side, returns false if the ring is empty
+bool ring_pop(ring_t *r, void *elem);
+// consumer side, look at the next element without removing it
+bool ring_peek(ring_t *r, void *elem);
+
+#endif
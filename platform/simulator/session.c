@@ -0,0 +1,292 @@
+#include "session.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "app.h"
+#include "timers.h"
+#include "timespec.h"
+
+#define NSEC_PER_SEC 1000000000
+
+static const char kSessionMagic[4] = { 'M', 'P', 'S', 'S' };
+#define kSessionVersion 1
+
+// several minutes at the simulator's tempo
+#define kSessionChunkLen 65536
+
+typedef enum {
+    kSessionIdle,
+    kSessionRecording,
+    kSessionReplaying,
+} session_mode_t;
+
+// set before the thread that owns the app starts, and read from it
+static _Atomic session_mode_t mode = kSessionIdle;
+
+// a recording is kept in fixed size chunks, so that the thread that owns the
+// app never allocates, session_service() keeps a spare chunk ready for it
+typedef struct session_chunk {
+    struct session_chunk *next;
+    size_t len;
+    session_record_t records[kSessionChunkLen];
+} session_chunk_t;
+
+static session_chunk_t *chunks = NULL;
+static session_chunk_t *chunk_last = NULL;
+// only set by session_service(), only taken by append()
+static _Atomic(session_chunk_t *) chunk_spare = NULL;
+// records lost because there was no spare chunk
+static size_t dropped = 0;
+
+// loaded for replay
+static session_record_t *records = NULL;
+static size_t records_len = 0;
+static size_t records_cap = 0;
+
+static struct timespec started;
+
+// only the first few mismatches are printed, the rest are just counted
+#define kMaxReported 10
+
+// replay position and results
+static size_t cursor = 0;
+static size_t mismatches = 0;
+
+static int64_t since_started(void) {
+    struct timespec t = timespec_sub(get_time(), started);
+    return (int64_t)t.tv_sec * NSEC_PER_SEC + t.tv_nsec;
+}
+
+// allocated and touched up front, so that filling it never page faults
+static session_chunk_t *chunk_new(void) {
+    session_chunk_t *c = malloc(sizeof(session_chunk_t));
+    if (c) memset(c, 0, sizeof(session_chunk_t));
+    return c;
+}
+
+static void append(session_record_t r) {
+    if (chunk_last->len == kSessionChunkLen) {
+        session_chunk_t *c = atomic_exchange(&chunk_spare, NULL);
+        if (!c) {
+            dropped++;
+            return;
+        }
+        chunk_last->next = c;
+        chunk_last = c;
+    }
+    r.at = since_started();
+    chunk_last->records[chunk_last->len++] = r;
+}
+
+static void chunks_free(void) {
+    while (chunks) {
+        session_chunk_t *next = chunks->next;
+        free(chunks);
+        chunks = next;
+    }
+    chunk_last = NULL;
+    free(atomic_exchange(&chunk_spare, NULL));
+}
+
+// FNV-1a
+static uint32_t hash(const uint8_t *data, size_t size) {
+    uint32_t h = 2166136261u;
+    for (size_t idx = 0; idx < size; idx++) {
+        h ^= data[idx];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+bool session_record_start(void) {
+    chunks = chunk_last = chunk_new();
+    if (!chunks) return false;
+    dropped = 0;
+
+    started = get_time();
+    mode = kSessionRecording;
+    session_service();
+    return true;
+}
+
+void session_service(void) {
+    if (mode != kSessionRecording || atomic_load(&chunk_spare)) return;
+    atomic_store(&chunk_spare, chunk_new());
+}
+
+bool session_record_stop(const char *path) {
+    mode = kSessionIdle;
+
+    bool ok = false;
+    FILE *f = fopen(path, "wb");
+    if (f) {
+        uint32_t version = kSessionVersion;
+        ok = fwrite(kSessionMagic, sizeof(kSessionMagic), 1, f) == 1 &&
+             fwrite(&version, sizeof(version), 1, f) == 1;
+        for (session_chunk_t *c = chunks; ok && c; c = c->next) {
+            ok = fwrite(c->records, sizeof(session_record_t), c->len, f) ==
+                 c->len;
+        }
+        if (fclose(f) != 0) ok = false;
+    }
+    if (dropped > 0) {
+        printf("Session recording dropped %zu records\n", dropped);
+    }
+
+    chunks_free();
+    return ok;
+}
+
+void session_press(uint8_t x, uint8_t y, uint8_t z) {
+    if (mode != kSessionRecording) return;
+    append((session_record_t){
+        .event = kSessionPress, .x = x, .y = y, .z = z });
+}
+
+void session_clock(bool phase) {
+    if (mode != kSessionRecording) return;
+    append((session_record_t){ .event = kSessionClock, .x = phase });
+}
+
+void session_reset(void) {
+    if (mode != kSessionRecording) return;
+    append((session_record_t){ .event = kSessionReset });
+}
+
+// replay: check that the app produced the next recorded result
+static void expect(const session_record_t *r) {
+    bool report = mismatches < kMaxReported;
+    if (cursor < records_len && records[cursor].event == r->event) {
+        const session_record_t *want = &records[cursor++];
+        if (want->x == r->x && want->y == r->y && want->value == r->value) {
+            return;
+        }
+        if (report) {
+            printf("Replay: record %zu at %.6fs differs\n", cursor - 1,
+                   (double)want->at / NSEC_PER_SEC);
+        }
+    }
+    else if (report) {
+        printf("Replay: unexpected %s after record %zu\n",
+               r->event == kSessionOutputs ? "outputs" : "frame", cursor);
+    }
+    mismatches++;
+}
+
+void session_outputs(uint8_t trigger_mask, bool clock) {
+    session_record_t r = { .event = kSessionOutputs,
+                           .x = trigger_mask,
+                           .y = clock };
+    if (mode == kSessionRecording) append(r);
+    if (mode == kSessionReplaying) expect(&r);
+}
+
+void session_frame(const uint8_t *leds, size_t size) {
+    session_record_t r = { .event = kSessionFrame, .value = hash(leds, size) };
+    if (mode == kSessionRecording) append(r);
+    if (mode == kSessionReplaying) expect(&r);
+}
+
+static bool load(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        printf("Could not open session %s\n", path);
+        return false;
+    }
+
+    char magic[sizeof(kSessionMagic)];
+    uint32_t version;
+    if (fread(magic, sizeof(magic), 1, f) != 1 ||
+        fread(&version, sizeof(version), 1, f) != 1 ||
+        memcmp(magic, kSessionMagic, sizeof(magic)) != 0 ||
+        version != kSessionVersion) {
+        printf("%s is not a session recording\n", path);
+        fclose(f);
+        return false;
+    }
+
+    session_record_t r;
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        if (records_len == records_cap) {
+            records_cap = records_cap ? records_cap * 2 : 1024;
+            records = realloc(records, records_cap * sizeof(session_record_t));
+            if (!records) abort();
+        }
+        records[records_len++] = r;
+    }
+    fclose(f);
+    return true;
+}
+
+static void sleep_until_ns(struct timespec start, int64_t at) {
+    struct timespec when = timespec_add(
+        start, (struct timespec){ .tv_sec = at / NSEC_PER_SEC,
+                                  .tv_nsec = at % NSEC_PER_SEC });
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) ==
+           EINTR) {
+    }
+}
+
+bool session_replay(const char *path, bool fast) {
+    records_len = records_cap = 0;
+    if (!load(path)) return false;
+
+    state_t state;
+    app_init(&state);
+
+    cursor = 0;
+    mismatches = 0;
+    mode = kSessionReplaying;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t inputs = 0;
+    while (cursor < records_len) {
+        const session_record_t r = records[cursor];
+        if (!fast && r.event <= kSessionReset) sleep_until_ns(start, r.at);
+
+        switch (r.event) {
+            case kSessionPress:
+                cursor++;
+                app_grid_press(&state, r.x, r.y, r.z);
+                inputs++;
+                break;
+            case kSessionClock:
+                cursor++;
+                app_clock(&state, r.x);
+                inputs++;
+                break;
+            case kSessionReset:
+                cursor++;
+                app_reset(&state);
+                inputs++;
+                break;
+            case kSessionFrame:
+                // the recorded session refreshed here, this consumes it
+                app_refresh(&state);
+                break;
+            default:
+                // outputs the app didn't produce this time
+                if (mismatches < kMaxReported) {
+                    printf("Replay: missing outputs at record %zu\n", cursor);
+                }
+                cursor++;
+                mismatches++;
+                break;
+        }
+    }
+
+    mode = kSessionIdle;
+    free(records);
+    records = NULL;
+    records_len = records_cap = 0;
+
+    printf("Replay: %zu inputs, %zu mismatches\n", inputs, mismatches);
+    return mismatches == 0;
+}
@@ -0,0 +1,55 @@
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Session recording and replay. A recording holds every input the app got
+// (key presses, clock edges and resets) with when it got them, along with
+// the outputs and LED frames that came out. Replaying feeds the inputs into
+// a fresh state_t and checks that the same outputs and frames come out.
+//
+// The file is a 8 byte header, "MPSS" and a uint32_t version, followed by
+// session_record_t records in native byte order.
+
+typedef enum {
+    kSessionPress = 0,    // x, y, z
+    kSessionClock = 1,    // x is the phase
+    kSessionReset = 2,
+    kSessionOutputs = 3,  // x is the trigger mask, y the clock output
+    kSessionFrame = 4,    // value is a hash of the LED buffer
+} session_event_t;
+
+typedef struct {
+    int64_t at;     // ns since recording started, from get_time()
+    uint8_t event;  // session_event_t
+    uint8_t x;
+    uint8_t y;
+    uint8_t z;
+    uint32_t value;
+} session_record_t;
+
+// records are kept in memory and only written out by session_record_stop(),
+// so recording does no I/O on the clock path, start before the thread that
+// owns the app and stop after it has finished
+bool session_record_start(void);
+bool session_record_stop(const char *path);
+// allocate memory for the recording to grow into, call regularly from a
+// thread other than the one that owns the app
+void session_service(void);
+
+// to be called alongside the app calls, from the thread that owns the app,
+// they do nothing when not recording or replaying
+void session_press(uint8_t x, uint8_t y, uint8_t z);
+void session_clock(bool phase);
+void session_reset(void);
+// from hardware_set_outputs() and grid_refresh()
+void session_outputs(uint8_t trigger_mask, bool clock);
+void session_frame(const uint8_t *leds, size_t size);
+
+// replay a recording at the recorded speed, or as fast as possible, returns
+// false if the file can't be read or the app's outputs or frames differ
+bool session_replay(const char *path, bool fast);
+
+#endif
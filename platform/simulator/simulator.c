@@ -1,21 +1,39 @@
+#define _GNU_SOURCE  // ppoll
+
+#include <getopt.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <monome.h>
 
 #include "app.h"
+#include "clock_thread.h"
 #include "csound.h"
 #include "hardware.h"
+#include "render.h"
+#include "ring.h"
+#include "session.h"
 #include "timers.h"
+#include "timespec.h"
+#include "trace.h"
+#include "vgrid.h"
 
 // flag to indicate that the simulator should quit (to help Csound quit)
-static bool quit_now = false;
+static volatile sig_atomic_t quit_now = false;
+// flag to indicate that the timer stats should be printed
+static volatile sig_atomic_t print_stats_now = false;
 
 // hardware has no concept of playing notes like Csound does,
 // this is used to compensate for that
-static bool trigger_playing[8] = { false };
+#define kNumOutputs 8
+static uint8_t triggers_playing = 0;
+static bool clock_output = false;
 
 // grid status
 #define GRID_SIZE 16
@@ -24,23 +42,142 @@ static uint8_t grid[GRID_SIZE][GRID_SIZE] = { { 0 } };
 #define QUADRANTS 4
 static bool quadrant_dirty[QUADRANTS] = { false };
 
-static monome_t *monome;
+// LED frames are handed from the app to the grid device through a lock-free
+// triple buffer, the app publishes its latest frame into 'ready' and the
+// device swaps it out whenever it is fresh
+typedef struct {
+    uint8_t leds[GRID_SIZE][GRID_SIZE];
+} frame_t;
+
+#define kFrameFresh 0x4u
+static frame_t frames[3];
+static atomic_uint frame_ready = 0;  // frame index, plus kFrameFresh
+// quadrants changed by published frames that the device hasn't sent yet, bit
+// per quadrant, so that a frame replaced before the device took it still has
+// its changes sent
+static atomic_uint frame_dirty = 0;
+static unsigned int frame_back = 1;   // owned by the app
+static unsigned int frame_front = 2;  // owned by the grid device
+
+// the internal clock's tempo
+#define kClockBpm (120.0 * 8)
+
+// NULL when running against the virtual grid
+static monome_t *monome = NULL;
 static state_t state;
 
-void hardware_set_clock_output(bool val) {
-    if (!val) printf("\n");
+// when the simulator started, scripted events are relative to this
+static struct timespec started;
+
+typedef struct {
+    const char *grid;    // serial device, or "virtual"
+    const char *script;  // key events for the virtual grid
+    const char *frames;  // where to save the virtual grid's LED frames
+    const char *trace;   // binary output trace, NULL for text on stdout
+    const char *record;  // where to save a recording of the session
+    const char *replay;  // recorded session to replay and check
+    bool replay_fast;
+    double duration;     // seconds to run for, 0 for until Ctrl-C
+    bool audio;
+    bool warp;  // run on virtual time, as fast as possible
+    uint32_t render_ticks;  // render patch files offline if > 0
+    long render_jobs;       // patches rendered at once
+    clock_thread_options_t clock_thread;
+    csound_options_t csound;
+} options_t;
+
+typedef struct {
+    uint8_t x;
+    uint8_t y;
+    uint8_t z;
+} key_press_t;
+
+// key presses waiting for the clock thread to pass them to the app
+static ring_t key_presses;
+static bool clock_threaded = false;
+
+static options_t options = { .grid = "/dev/ttyUSB0",
+                             .script = NULL,
+                             .frames = NULL,
+                             .trace = NULL,
+                             .record = NULL,
+                             .replay = NULL,
+                             .replay_fast = false,
+                             .duration = 0,
+                             .audio = true,
+                             .warp = false,
+                             .render_ticks = 0,
+                             .render_jobs = 0,
+                             .clock_thread = { .priority = 0, .cpu = -1 } };
+
+static struct timespec elapsed(void) {
+    return timespec_sub(get_time(), started);
+}
+
+// grid device, either a real monome or the virtual grid
+static void device_led_level_map(uint8_t x_off, uint8_t y_off,
+                                 const uint8_t *data) {
+    if (monome) {
+        monome_led_level_map(monome, x_off, y_off, data);
+    }
+    else {
+        vgrid_led_level_map(elapsed(), x_off, y_off, data);
+    }
+}
+
+static void device_led_level_row(uint8_t x_off, uint8_t y,
+                                 const uint8_t *data) {
+    if (monome) {
+        monome_led_level_row(monome, x_off, y, 8, data);
+    }
+    else {
+        vgrid_led_level_row(elapsed(), x_off, y, data);
+    }
+}
+
+static void device_led_level_set(uint8_t x, uint8_t y, uint8_t level) {
+    if (monome) {
+        monome_led_level_set(monome, x, y, level);
+    }
+    else {
+        vgrid_led_level_set(elapsed(), x, y, level);
+    }
 }
 
-void hardware_set_trigger_output(uint8_t idx, bool val) {
-    if (val) {
-        printf("T%d", idx);
-        trigger_playing[idx] = true;
-        csound_set_trigger_output(idx, true);
+static void device_led_all(uint8_t level) {
+    if (monome) {
+        monome_led_all(monome, level);
+    }
+    else {
+        vgrid_led_all(level);
     }
-    else if (trigger_playing[idx] == true) {
-        trigger_playing[idx] = false;
-        csound_set_trigger_output(idx, false);
+}
+
+void hardware_set_outputs(uint8_t trigger_mask, bool clock) {
+    if (render_set_outputs(trigger_mask, clock)) return;
+    session_outputs(trigger_mask, clock);
+
+    uint8_t on = trigger_mask & ~triggers_playing;
+    uint8_t off = triggers_playing & ~trigger_mask;
+    if (on || off) csound_set_trigger_outputs(on, off);
+    triggers_playing = trigger_mask;
+
+    for (uint8_t idx = 0; idx < kNumOutputs; idx++) {
+        if ((on | off) & (1 << idx)) {
+            trace_record(kTraceTrigger, idx, (uint8_t)((on >> idx) & 1));
+        }
     }
+    if (clock != clock_output) trace_record(kTraceClock, 0, clock);
+    clock_output = clock;
+}
+
+// the app is only ever run from one thread at a time, see press()
+uint32_t hardware_irq_save(void) {
+    return 0;
+}
+
+void hardware_irq_restore(uint32_t flags) {
+    (void)flags;
 }
 
 void grid_set_dirty(uint8_t quadrant) {
@@ -57,97 +194,489 @@ void grid_set(uint8_t x, uint8_t y, uint8_t level) {
     grid[y][x] = level;
 }
 
+void grid_copy_rows(uint8_t y, uint8_t rows, const uint8_t *levels) {
+    if (y >= GRID_SIZE) return;
+    if (rows > GRID_SIZE - y) rows = GRID_SIZE - y;
+    memcpy(grid[y], levels, rows * GRID_SIZE);
+}
+
 void grid_refresh() {
-    for (uint8_t q = 0; q < 4; q++) {
-        if (quadrant_dirty[q] == false) continue;
-
-        uint8_t off_x = 0;
-        uint8_t off_y = 0;
-        switch (q) {
-            case 0:
-                off_x = 0;
-                off_y = 0;
-                break;
-            case 1:
-                off_x = 8;
-                off_y = 0;
-                break;
-            case 2:
-                off_x = 8;
-                off_y = 0;
-                break;
-            case 3:
-                off_x = 8;
-                off_y = 8;
-                break;
+    session_frame(&grid[0][0], sizeof(grid));
+
+    frame_t *f = &frames[frame_back];
+    memcpy(f->leds, grid, sizeof(grid));
+    unsigned int dirty = 0;
+    for (uint8_t q = 0; q < QUADRANTS; q++) {
+        if (quadrant_dirty[q]) dirty |= 1u << q;
+        quadrant_dirty[q] = false;
+    }
+
+    unsigned int prev = atomic_exchange(&frame_ready, frame_back | kFrameFresh);
+    frame_back = prev & ~kFrameFresh;
+    // only once the frame is published, see flush_frame()
+    atomic_fetch_or(&frame_dirty, dirty);
+}
+
+// what the grid device is currently showing
+static uint8_t shadow[GRID_SIZE][GRID_SIZE] = { { 0 } };
+
+// approximate serial bytes for each libmonome call (mext protocol), used to
+// pick the cheapest way to send a quadrant's changes
+#define kLevelSetCost 4
+#define kLevelRowCost 7
+#define kLevelMapCost 35
+
+// send the changes in one quadrant of f, relative to the shadow
+static void flush_quadrant(const frame_t *f, uint8_t q) {
+    // quadrants are numbered left to right, top to bottom
+    const uint8_t off_x = (q % 2) * 8;
+    const uint8_t off_y = (q / 2) * 8;
+
+    uint8_t rows_changed = 0;  // bit per row
+    unsigned int cells_changed = 0;
+    for (uint8_t y = 0; y < 8; y++) {
+        for (uint8_t x = 0; x < 8; x++) {
+            if (f->leds[off_y + y][off_x + x] != shadow[off_y + y][off_x + x]) {
+                rows_changed |= (uint8_t)(1 << y);
+                cells_changed++;
+            }
+        }
+    }
+    if (cells_changed == 0) return;
+
+    unsigned int rows = (unsigned int)__builtin_popcount(rows_changed);
+    unsigned int set_cost = cells_changed * kLevelSetCost;
+    unsigned int row_cost = rows * kLevelRowCost;
+
+    if (set_cost <= row_cost && set_cost <= kLevelMapCost) {
+        for (uint8_t y = off_y; y < off_y + 8; y++) {
+            for (uint8_t x = off_x; x < off_x + 8; x++) {
+                if (f->leds[y][x] == shadow[y][x]) continue;
+                device_led_level_set(x, y, f->leds[y][x]);
+                shadow[y][x] = f->leds[y][x];
+            }
+        }
+    }
+    else if (row_cost <= kLevelMapCost) {
+        for (uint8_t y = 0; y < 8; y++) {
+            if (!(rows_changed & (1 << y))) continue;
+            const uint8_t *row = &f->leds[off_y + y][off_x];
+            device_led_level_row(off_x, off_y + y, row);
+            memcpy(&shadow[off_y + y][off_x], row, 8);
         }
+    }
+    else {
         uint8_t data[64];
         for (uint8_t y = 0; y < 8; y++) {
-            for (uint8_t x = 0; x < 8; x++) {
-                data[y * 8 + x] = grid[y + off_y][x + off_x];
-            }
+            memcpy(&data[y * 8], &f->leds[off_y + y][off_x], 8);
+            memcpy(&shadow[off_y + y][off_x], &data[y * 8], 8);
         }
-        monome_led_level_map(monome, off_x, off_y, data);
-        quadrant_dirty[q] = false;
+        device_led_level_map(off_x, off_y, data);
     }
 }
 
+// send the latest published frame to the grid device
+static void flush_frame() {
+    // taken before the frame, so any quadrant here belongs to a frame that
+    // has already been published, and the latest frame holds its changes
+    unsigned int dirty = atomic_exchange(&frame_dirty, 0);
+    if (atomic_load(&frame_ready) & kFrameFresh) {
+        frame_front = atomic_exchange(&frame_ready, frame_front) & ~kFrameFresh;
+    }
+
+    const frame_t *f = &frames[frame_front];
+    for (uint8_t q = 0; q < QUADRANTS; q++) {
+        if (dirty & (1u << q)) flush_quadrant(f, q);
+    }
+}
+
+// key press into the app, on the thread that owns it
+static void app_press(uint8_t x, uint8_t y, uint8_t z) {
+    session_press(x, y, z);
+    app_grid_press(&state, x, y, z);
+}
+
+// pass a key press to the app, via the clock thread if it owns the app
+static void press(uint8_t x, uint8_t y, uint8_t z) {
+    if (!clock_threaded) {
+        app_press(x, y, z);
+        return;
+    }
+
+    key_press_t k = { .x = x, .y = y, .z = z };
+    if (!ring_push(&key_presses, &k)) printf("Key press dropped\n");
+}
+
 static void handle_press(const monome_event_t *e, void *user_data) {
     uint8_t x = (uint8_t)e->grid.x;
     uint8_t y = (uint8_t)e->grid.y;
     uint8_t z = (uint8_t)user_data;
-    app_grid_press(&state, x, y, z);
+    press(x, y, z);
 }
 
 static void handle_clock() {
     static bool clock = false;  // start clock low
+    session_clock(clock);
     app_clock(&state, clock);
     clock = !clock;
 }
 
-static void handle_refresh() {
+// runs on the same thread as the clock, drains key presses and renders
+static void handle_service() {
+    key_press_t k;
+    while (ring_pop(&key_presses, &k)) app_press(k.x, k.y, k.z);
     if (app_grid_is_dirty(&state)) app_refresh(&state);
 }
 
+static void handle_refresh() {
+    if (!clock_threaded) handle_service();
+    flush_frame();
+}
+
 static void set_quit_now() {
     quit_now = true;
 }
 
-int main() {
-    app_init(&state);
+static void set_print_stats_now() {
+    print_stats_now = true;
+}
 
-    monome = monome_open("/dev/ttyUSB0");
+static void print_stats() {
+    print_timer_stats(stderr);
+    if (clock_threaded) clock_thread_print_stats(stderr);
+}
+
+static void handle_virtual_keys() {
+    uint8_t x, y, z;
+    while (vgrid_next_key(elapsed(), &x, &y, &z)) {
+        press(x, y, z);
+    }
+}
+
+// names a Csound preset when --audio-preset isn't given
+#define kAudioPresetEnv "SIMULATOR_AUDIO_PRESET"
+
+// long options without a short form
+enum { kOptionKsmps = 256, kOptionReplayFast };
+
+static void usage(const char *name) {
+    printf("usage: %s [options]\n", name);
+    printf("       %s --render=TICKS [options] PATCH...\n", name);
+    printf("       %s --replay=FILE [--replay-fast]\n", name);
+    printf("  -g, --grid=DEVICE     grid serial device, or 'virtual' "
+           "(default /dev/ttyUSB0)\n");
+    printf("  -s, --script=FILE     key events for the virtual grid\n");
+    printf("  -f, --frames=FILE     save the virtual grid's LED frames\n");
+    printf("  -t, --trace=FILE      write a binary output trace to FILE "
+           "instead of text\n");
+    printf("                        on stdout\n");
+    printf("  -R, --record=FILE     record the session's inputs and outputs "
+           "to FILE\n");
+    printf("  -P, --replay=FILE     replay a recorded session and check it "
+           "still matches\n");
+    printf("      --replay-fast     replay as fast as possible rather than "
+           "at recorded speed\n");
+    printf("  -d, --duration=SECS   stop after SECS seconds\n");
+    printf("  -n, --no-audio        do not start Csound\n");
+    printf("  -w, --warp            run on virtual time as fast as possible "
+           "(virtual grid only, implies --no-audio)\n");
+    printf("  -p, --rt-priority=N   run the clock thread with SCHED_FIFO "
+           "priority N\n");
+    printf("  -c, --cpu=N           pin the clock thread to CPU N\n");
+    printf("  -a, --audio-preset=P  Csound buffers: default, low-latency or "
+           "low-cpu\n");
+    printf("                        (or set %s)\n", kAudioPresetEnv);
+    printf("      --ksmps=N         Csound control block size\n");
+    printf("  -b, --buffer=N        samples rendered per Csound call\n");
+    printf("  -B, --hw-buffer=N     samples queued on the sound card\n");
+    printf("  -r, --render=TICKS    render each PATCH file for TICKS clock "
+           "ticks to a WAV\n");
+    printf("                        file next to it, as fast as possible\n");
+    printf("  -j, --jobs=N          patches to render at once (default one "
+           "per CPU)\n");
+}
+
+// sleep until when, waking early to handle key presses from the monome
+static void wait_until(struct timespec when) {
     if (!monome) {
-        printf("Connection failed\n");
-        return -1;
+        sleep_till_before(when);
+        return;
+    }
+
+    struct timespec till = timespec_sub(when, get_time());
+    if (timespec_le(till, (struct timespec){ .tv_sec = 0, .tv_nsec = 0 })) {
+        return;
+    }
+
+    struct pollfd fds = { .fd = monome_get_fd(monome), .events = POLLIN };
+    ppoll(&fds, 1, &till, NULL);
+}
+
+static bool parse_options(int argc, char *argv[]) {
+    const struct option long_options[] = {
+        { "grid", required_argument, NULL, 'g' },
+        { "script", required_argument, NULL, 's' },
+        { "frames", required_argument, NULL, 'f' },
+        { "trace", required_argument, NULL, 't' },
+        { "record", required_argument, NULL, 'R' },
+        { "replay", required_argument, NULL, 'P' },
+        { "replay-fast", no_argument, NULL, kOptionReplayFast },
+        { "duration", required_argument, NULL, 'd' },
+        { "no-audio", no_argument, NULL, 'n' },
+        { "warp", no_argument, NULL, 'w' },
+        { "rt-priority", required_argument, NULL, 'p' },
+        { "cpu", required_argument, NULL, 'c' },
+        { "audio-preset", required_argument, NULL, 'a' },
+        { "ksmps", required_argument, NULL, kOptionKsmps },
+        { "buffer", required_argument, NULL, 'b' },
+        { "hw-buffer", required_argument, NULL, 'B' },
+        { "render", required_argument, NULL, 'r' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    options.csound = kCsoundDefault;
+    const char *preset = getenv(kAudioPresetEnv);
+    if (preset && !csound_preset(preset, &options.csound)) {
+        printf("Unknown %s '%s'\n", kAudioPresetEnv, preset);
+        return false;
+    }
+
+    int c;
+    while ((c = getopt_long(argc, argv, "g:s:f:t:R:P:d:nwp:c:a:b:B:r:j:h",
+                            long_options, NULL)) != -1) {
+        switch (c) {
+            case 'g': options.grid = optarg; break;
+            case 's': options.script = optarg; break;
+            case 'f': options.frames = optarg; break;
+            case 't': options.trace = optarg; break;
+            case 'R': options.record = optarg; break;
+            case 'P': options.replay = optarg; break;
+            case kOptionReplayFast: options.replay_fast = true; break;
+            case 'd': options.duration = atof(optarg); break;
+            case 'n': options.audio = false; break;
+            case 'w': options.warp = true; break;
+            case 'p': options.clock_thread.priority = atoi(optarg); break;
+            case 'c': options.clock_thread.cpu = atoi(optarg); break;
+            case 'a':
+                if (!csound_preset(optarg, &options.csound)) {
+                    printf("Unknown audio preset '%s'\n", optarg);
+                    return false;
+                }
+                break;
+            case kOptionKsmps: options.csound.ksmps = atoi(optarg); break;
+            case 'b': options.csound.buffer = atoi(optarg); break;
+            case 'B': options.csound.hw_buffer = atoi(optarg); break;
+            case 'r':
+                options.render_ticks = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'j': options.render_jobs = atol(optarg); break;
+            default: usage(argv[0]); return false;
+        }
+    }
+
+    if (options.csound.ksmps <= 0 || options.csound.buffer <= 0 ||
+        options.csound.hw_buffer < options.csound.buffer) {
+        printf("Audio buffers must be positive, with --hw-buffer at least "
+               "--buffer\n");
+        return false;
+    }
+
+    if (options.render_ticks > 0 && optind >= argc) {
+        printf("--render needs at least one patch file\n");
+        return false;
+    }
+
+    if (options.warp) {
+        if (strcmp(options.grid, "virtual") != 0) {
+            printf("--warp needs --grid=virtual\n");
+            return false;
+        }
+        // audio can only run in real time
+        options.audio = false;
+    }
+    return true;
+}
+
+// render each patch file to a WAV file with the same name
+static void free_jobs(render_job_t *jobs, int count) {
+    // outputs that were never allocated are still NULL from calloc()
+    for (int idx = 0; idx < count; idx++) free((char *)jobs[idx].output);
+    free(jobs);
+}
+
+static int render(int count, char *paths[]) {
+    render_job_t *jobs = calloc((size_t)count, sizeof(render_job_t));
+    if (!jobs) return -1;
+
+    for (int idx = 0; idx < count; idx++) {
+        const char *path = paths[idx];
+        const char *dot = strrchr(path, '.');
+        const char *slash = strrchr(path, '/');
+        size_t len = (dot && (!slash || dot > slash)) ? (size_t)(dot - path)
+                                                      : strlen(path);
+        char *output = malloc(len + sizeof(".wav"));
+        if (!output) {
+            free_jobs(jobs, count);
+            return -1;
+        }
+        memcpy(output, path, len);
+        strcpy(output + len, ".wav");
+
+        jobs[idx] = (render_job_t){ .patch = path, .output = output };
+    }
+
+    long jobs_at_once = options.render_jobs;
+    if (jobs_at_once <= 0) jobs_at_once = sysconf(_SC_NPROCESSORS_ONLN);
+
+    bool ok = render_patches(jobs, (size_t)count, options.render_ticks,
+                             clock_period(kClockBpm),
+                             (unsigned int)jobs_at_once, &options.csound);
+    for (int idx = 0; idx < count; idx++) {
+        if (jobs[idx].ok) printf("%s\n", jobs[idx].output);
+    }
+    free_jobs(jobs, count);
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    if (!parse_options(argc, argv)) return -1;
+
+    // offline, needs no grid or sound card
+    if (options.render_ticks > 0) {
+        return render(argc - optind, &argv[optind]);
+    }
+    if (options.replay) {
+        return session_replay(options.replay, options.replay_fast) ? 0 : -1;
+    }
+
+    bool virtual_grid = strcmp(options.grid, "virtual") == 0;
+
+    app_init(&state);
+
+    if (virtual_grid) {
+        if (!vgrid_open(options.script)) return -1;
+    }
+    else {
+        monome = monome_open(options.grid);
+        if (!monome) {
+            printf("Connection failed\n");
+            return -1;
+        }
     }
 
     // Ctrl-C handler
     signal(SIGINT, set_quit_now);
+    // dump timer stats with 'kill -USR1'
+    signal(SIGUSR1, set_print_stats_now);
+
+    if (options.audio) start_csound(&options.csound);
+
+    if (monome) {
+        monome_register_handler(monome, MONOME_BUTTON_DOWN, handle_press,
+                                (void *)0);
+        monome_register_handler(monome, MONOME_BUTTON_UP, handle_press,
+                                (void *)1);
+    }
+
+    // the trace is written from its own thread, away from the clock
+    FILE *trace_out = stdout;
+    if (options.trace) {
+        trace_out = fopen(options.trace, "wb");
+        if (!trace_out) {
+            printf("Could not open trace %s\n", options.trace);
+            return -1;
+        }
+    }
+    const trace_options_t trace_options = { .binary = options.trace != NULL,
+                                            .block_when_full = options.warp };
+    if (!trace_start(trace_out, &trace_options)) return -1;
 
-    start_csound();
+    // start from a known state, matching the shadow
+    device_led_all(0);
 
-    monome_register_handler(monome, MONOME_BUTTON_DOWN, handle_press,
-                            (void *)0);
-    monome_register_handler(monome, MONOME_BUTTON_UP, handle_press, (void *)1);
+    set_virtual_time(options.warp);
 
-    setbuf(stdout, NULL);
+    // before the clock starts, so the first edges are recorded
+    if (options.record && !session_record_start()) return -1;
 
-    set_clock_callback(handle_clock);
-    set_clock_rate(120.0 * 8);
+    // warp runs everything on one thread, to keep it deterministic
+    if (options.warp) {
+        set_clock_callback(handle_clock);
+        set_clock_rate(kClockBpm);
+    }
+    else {
+        if (!ring_init(&key_presses, sizeof(key_press_t), 256)) return -1;
+        const struct timespec service_every = timespec_from_ms(5);
+        clock_threaded = clock_thread_start(clock_period(kClockBpm),
+                                            service_every, handle_clock,
+                                            handle_service,
+                                            &options.clock_thread);
+        if (!clock_threaded) return -1;
+    }
     set_refresh_callback(handle_refresh);
 
+    started = get_time();
+    const struct timespec duration = timespec_from_double(options.duration);
+
     while (!quit_now) {
-        while (monome_event_handle_next(monome)) {
+        if (monome) {
+            while (monome_event_handle_next(monome)) {
+            }
+        }
+        else {
+            handle_virtual_keys();
         }
+
         struct timespec next = process_timers();
-        sleep_till_before(next);
+
+        // don't sleep through the next scripted key press
+        struct timespec key;
+        if (!monome && vgrid_next_key_time(&key)) {
+            key = timespec_add(started, key);
+            if (timespec_lt(key, next)) next = key;
+        }
+
+        session_service();
+
+        if (print_stats_now) {
+            print_stats_now = false;
+            print_stats();
+        }
+
+        if (options.duration > 0 && timespec_ge(elapsed(), duration)) break;
+
+        wait_until(next);
     }
 
-    monome_led_all(monome, 0);
-    monome_close(monome);
+    if (clock_threaded) {
+        clock_thread_stop();
+        ring_free(&key_presses);
+    }
+
+    trace_stop();
+    if (options.trace) fclose(trace_out);
+
+    if (options.record && !session_record_stop(options.record)) {
+        printf("Could not write session to %s\n", options.record);
+    }
+
+    print_stats();
+
+    device_led_all(0);
+    if (monome) {
+        monome_close(monome);
+    }
+    else {
+        printf("\n%zu frames captured\n", vgrid_frame_count());
+        if (options.frames && !vgrid_write_frames(options.frames)) {
+            printf("Could not write frames to %s\n", options.frames);
+        }
+        vgrid_close();
+    }
 
-    stop_csound();
+    if (options.audio) stop_csound();
 
     return 0;
 };
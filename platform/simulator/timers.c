@@ -1,73 +1,221 @@
 #include "timers.h"
 
+#include <stdint.h>
+#include <stdlib.h>
 #include <time.h>
 
+#include "clock_thread.h"
 #include "timespec.h"
 
 #define NSEC_PER_MS 1000000
-#define NUM_TIMERS 2
-
-typedef struct {
-    struct timespec every;
-    struct timespec next;
-    void (*callback)();
-} event_timer_t;
+#define NSEC_PER_SEC 1000000000
 
 const struct timespec kNullTimeSpec = { .tv_sec = 0, .tv_nsec = 0 };
 
-event_timer_t clock_timer = { .every = { .tv_sec = 0,
-                                         .tv_nsec = 50 * NSEC_PER_MS },
-                              .next = { .tv_sec = 0, .tv_nsec = 0 },
-                              .callback = NULL };
+static event_timer_t clock_timer = { .heap_idx = SIZE_MAX };
+static event_timer_t refresh_timer = { .heap_idx = SIZE_MAX };
+
+// binary min-heap of timers ordered by their next deadline
+static event_timer_t **heap = NULL;
+static size_t heap_len = 0;
+static size_t heap_cap = 0;
+
+static bool virtual_time = false;
+static struct timespec virtual_now = { .tv_sec = 0, .tv_nsec = 0 };
+
+void set_virtual_time(bool enabled) {
+    virtual_time = enabled;
+    virtual_now = kNullTimeSpec;
+}
+
+struct timespec get_time() {
+    if (virtual_time) return virtual_now;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now;
+}
+
+// heap
+
+static void heap_place(size_t idx, event_timer_t *t) {
+    heap[idx] = t;
+    t->heap_idx = idx;
+}
+
+static void heap_sift_up(size_t idx) {
+    event_timer_t *t = heap[idx];
+    while (idx > 0) {
+        size_t parent = (idx - 1) / 2;
+        if (!timespec_lt(t->next, heap[parent]->next)) break;
+        heap_place(idx, heap[parent]);
+        idx = parent;
+    }
+    heap_place(idx, t);
+}
+
+static void heap_sift_down(size_t idx) {
+    event_timer_t *t = heap[idx];
+    while (true) {
+        size_t child = idx * 2 + 1;
+        if (child >= heap_len) break;
+        if (child + 1 < heap_len &&
+            timespec_lt(heap[child + 1]->next, heap[child]->next)) {
+            child++;
+        }
+        if (!timespec_lt(heap[child]->next, t->next)) break;
+        heap_place(idx, heap[child]);
+        idx = child;
+    }
+    heap_place(idx, t);
+}
+
+static void heap_update(size_t idx) {
+    if (idx > 0 && timespec_lt(heap[idx]->next, heap[(idx - 1) / 2]->next)) {
+        heap_sift_up(idx);
+    }
+    else {
+        heap_sift_down(idx);
+    }
+}
+
+// timers
+
+static int64_t to_ns(struct timespec ts) {
+    return (int64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static struct timespec real_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now;
+}
+
+void timer_add(event_timer_t *t, const char *name, struct timespec every,
+               timer_policy_t policy, void (*callback)()) {
+    if (t->heap_idx != SIZE_MAX) timer_remove(t);
+
+    if (heap_len == heap_cap) {
+        heap_cap = heap_cap ? heap_cap * 2 : 8;
+        heap = realloc(heap, heap_cap * sizeof(event_timer_t *));
+        if (!heap) abort();
+    }
+
+    t->name = name;
+    t->every = every;
+    t->next = get_time();
+    t->policy = policy;
+    t->callback = callback;
 
-event_timer_t refresh_timer = { .every = { .tv_sec = 0,
-                                           .tv_nsec = 50 * NSEC_PER_MS },
-                                .next = { .tv_sec = 0, .tv_nsec = 0 },
-                                .callback = NULL };
+    heap_place(heap_len++, t);
+    heap_sift_up(t->heap_idx);
+}
 
+void timer_remove(event_timer_t *t) {
+    size_t idx = t->heap_idx;
+    if (idx == SIZE_MAX) return;
 
-event_timer_t *const timers[NUM_TIMERS] = { &clock_timer, &refresh_timer };
+    t->heap_idx = SIZE_MAX;
+    heap_len--;
+    if (idx == heap_len) return;
+
+    heap_place(idx, heap[heap_len]);
+    heap_update(idx);
+}
+
+void timer_set_every(event_timer_t *t, struct timespec every) {
+    if (t->heap_idx != SIZE_MAX) {
+        // move the pending deadline so it is 'every' after the last firing
+        struct timespec last = timespec_sub(t->next, t->every);
+        t->next = timespec_add(last, every);
+        // a shorter period can't make the timer late
+        struct timespec now = get_time();
+        if (timespec_lt(t->next, now)) t->next = now;
+        heap_update(t->heap_idx);
+    }
+    t->every = every;
+}
 
 void set_clock_callback(void (*callback)()) {
-    clock_timer.callback = callback;
+    // keep any rate set by set_clock_rate()
+    struct timespec every = clock_timer.every;
+    if (timespec_eq(every, kNullTimeSpec)) {
+        every = (struct timespec){ .tv_sec = 0, .tv_nsec = 50 * NSEC_PER_MS };
+    }
+    // the clock must not lose ticks, or it drifts out of phase
+    timer_add(&clock_timer, "clock", every, kTimerCatchUp, callback);
 }
 
 void set_refresh_callback(void (*callback)()) {
-    refresh_timer.callback = callback;
+    // a late refresh is as good as several
+    timer_add(&refresh_timer, "refresh",
+              (struct timespec){ .tv_sec = 0, .tv_nsec = 50 * NSEC_PER_MS },
+              kTimerSkip, callback);
 }
 
-void set_clock_rate(double bpm) {
+struct timespec clock_period(double bpm) {
     if (bpm <= 0) bpm = 120.0;
 
     // clock goes up and down for each beat
-    clock_timer.every = timespec_from_double(60 / bpm / 2);
+    return timespec_from_double(60 / bpm / 2);
 }
 
-struct timespec process_timers() {
-    struct timespec next_timer = kNullTimeSpec;
-
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
+void set_clock_rate(double bpm) {
+    struct timespec period = clock_period(bpm);
+    timer_set_every(&clock_timer, period);
+    // whichever of the two is driving the clock
+    clock_thread_set_period(period);
+}
 
-    for (size_t i = 0; i < NUM_TIMERS; i++) {
-        event_timer_t *t = timers[i];
-        if (timespec_ge(now, t->next)) {
-            // fire the callback
-            if (t->callback) (*t->callback)();
-            t->next = timespec_add(now, t->every);
+struct timespec process_timers() {
+    struct timespec now = get_time();
+
+    while (heap_len > 0 && timespec_le(heap[0]->next, now)) {
+        event_timer_t *t = heap[0];
+
+        int64_t late = to_ns(timespec_sub(now, t->next));
+        histogram_record(&t->lateness, late);
+        // a skipping timer counts the deadlines it jumps over below instead
+        if (t->policy != kTimerSkip && late >= to_ns(t->every)) t->missed++;
+
+        // fire the callback
+        struct timespec started = real_time();
+        if (t->callback) (*t->callback)();
+        histogram_record(&t->duration,
+                         to_ns(timespec_sub(real_time(), started)));
+
+        // a timer may remove itself
+        if (t->heap_idx == SIZE_MAX) continue;
+
+        // absolute deadlines, so lateness never accumulates into the period
+        t->next = timespec_add(t->next, t->every);
+
+        if (t->policy == kTimerSkip && timespec_le(t->next, now)) {
+            // jump to the first deadline after now on the original phase
+            struct timespec behind = timespec_sub(now, t->next);
+            struct timespec phase = timespec_mod(behind, t->every);
+            t->next = timespec_add(timespec_sub(now, phase), t->every);
+            t->missed += (uint64_t)(to_ns(behind) / to_ns(t->every)) + 1;
         }
-        if (timespec_gt(t->next, next_timer)) next_timer = t->next;
+
+        heap_update(t->heap_idx);
     }
 
-    return next_timer;
+    if (heap_len == 0) return timespec_add(now, timespec_from_ms(50));
+    return heap[0]->next;
 }
 
 void sleep_till_before(struct timespec when) {
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct timespec now = get_time();
 
     if (timespec_le(when, now)) return;
 
+    if (virtual_time) {
+        // nothing can happen in between, so skip straight there
+        virtual_now = when;
+        return;
+    }
+
     struct timespec till = timespec_sub(when, now);
 
     const struct timespec a_little = { .tv_sec = 0, .tv_nsec = 1000 };
@@ -76,3 +224,13 @@ void sleep_till_before(struct timespec when) {
 
     nanosleep(&till, (struct timespec *)NULL);
 }
+
+void print_timer_stats(FILE *f) {
+    for (size_t i = 0; i < heap_len; i++) {
+        event_timer_t *t = heap[i];
+        fprintf(f, "timer %s: %lu missed deadlines\n", t->name,
+                (unsigned long)t->missed);
+        histogram_print(&t->lateness, "lateness", f);
+        histogram_print(&t->duration, "duration", f);
+    }
+}
@@ -1,14 +1,62 @@
 #ifndef _TIMERS_H_
 #define _TIMERS_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <time.h>
 
+#include "histogram.h"
+
+// what to do when a timer's deadline has already passed by more than one
+// period by the time it gets to run
+typedef enum {
+    kTimerCatchUp,  // fire once for every missed deadline
+    kTimerSkip,     // drop the missed deadlines, keeping the original phase
+} timer_policy_t;
+
+typedef struct {
+    const char *name;
+    struct timespec every;
+    struct timespec next;  // absolute deadline
+    timer_policy_t policy;
+    void (*callback)();
+    size_t heap_idx;  // position in the scheduler, SIZE_MAX if not added
+
+    // instrumentation
+    histogram_t lateness;  // how long after its deadline the callback ran
+    histogram_t duration;  // how long the callback took (always real time)
+    uint64_t missed;       // deadlines a whole period or more late
+} event_timer_t;
+
+// add a timer (owned by the caller) that first fires on the next call to
+// process_timers() and then every period after that, every must be > 0
+void timer_add(event_timer_t *t, const char *name, struct timespec every,
+               timer_policy_t policy, void (*callback)());
+void timer_remove(event_timer_t *t);
+// change the period, keeping the time of the last firing as the phase
+void timer_set_every(event_timer_t *t, struct timespec every);
 
 void set_clock_callback(void (*callback)());
 void set_refresh_callback(void (*callback)());
 
+// for the clock timer, or the clock thread when that is running
 void set_clock_rate(double bpm);
+// the clock timer's period (half a beat) at a tempo
+struct timespec clock_period(double bpm);
+
+// run on a virtual clock that starts at zero and jumps straight to each
+// deadline instead of sleeping, must be set before any timers are added
+void set_virtual_time(bool enabled);
+// the current (possibly virtual) monotonic time
+struct timespec get_time(void);
+
+// fire every timer that is due, returns the earliest remaining deadline
 struct timespec process_timers(void);
 void sleep_till_before(struct timespec when);
 
+// dump the lateness and duration histograms for every timer
+void print_timer_stats(FILE *f);
+
 #endif
@@ -0,0 +1,110 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "ring.h"
+#include "timers.h"
+
+#define NSEC_PER_SEC 1000000000
+
+// about 40 seconds of every output changing at the simulator's tempo
+#define kTraceCapacity 4096
+// how long the writer sleeps when the ring is empty
+#define kTraceDrainNs (10 * 1000000)
+
+static ring_t records;
+static FILE *trace_out = NULL;
+static trace_options_t trace_options;
+static pthread_t writer;
+static atomic_bool running = false;
+static atomic_bool stop_now = false;
+static atomic_uint records_dropped = 0;
+
+// human format, trigger lines are ended by the falling clock edge
+static void write_human(const trace_record_t *r) {
+    switch (r->event) {
+        case kTraceTrigger:
+            if (r->value) fprintf(trace_out, "T%u", r->index);
+            break;
+        case kTraceClock:
+            if (!r->value) fputc('\n', trace_out);
+            break;
+    }
+}
+
+// returns the number of records written
+static size_t drain(void) {
+    size_t count = 0;
+    trace_record_t r;
+    while (ring_pop(&records, &r)) {
+        if (trace_options.binary) {
+            fwrite(&r, sizeof(r), 1, trace_out);
+        }
+        else {
+            write_human(&r);
+        }
+        count++;
+    }
+    if (count) fflush(trace_out);
+    return count;
+}
+
+static void *trace_writer(void *arg) {
+    (void)arg;
+
+    const struct timespec idle = { .tv_sec = 0, .tv_nsec = kTraceDrainNs };
+    while (!atomic_load(&stop_now)) {
+        if (drain() == 0) nanosleep(&idle, NULL);
+    }
+    drain();
+    return NULL;
+}
+
+bool trace_start(FILE *out, const trace_options_t *options) {
+    if (!ring_init(&records, sizeof(trace_record_t), kTraceCapacity)) {
+        return false;
+    }
+
+    trace_out = out;
+    trace_options = *options;
+    atomic_store(&stop_now, false);
+    if (pthread_create(&writer, NULL, trace_writer, NULL) != 0) {
+        ring_free(&records);
+        return false;
+    }
+    atomic_store(&running, true);
+    return true;
+}
+
+void trace_stop(void) {
+    if (!atomic_load(&running)) return;
+
+    atomic_store(&running, false);
+    atomic_store(&stop_now, true);
+    pthread_join(writer, NULL);
+    ring_free(&records);
+
+    unsigned int dropped = atomic_load(&records_dropped);
+    if (dropped) fprintf(stderr, "Trace: %u records dropped\n", dropped);
+}
+
+void trace_record(trace_event_t event, uint8_t index, uint8_t value) {
+    if (!atomic_load_explicit(&running, memory_order_relaxed)) return;
+
+    struct timespec now = get_time();
+    trace_record_t r = { .at = (int64_t)now.tv_sec * NSEC_PER_SEC +
+                               now.tv_nsec,
+                         .event = (uint8_t)event,
+                         .index = index,
+                         .value = value };
+    while (!ring_push(&records, &r)) {
+        if (!trace_options.block_when_full) {
+            atomic_fetch_add(&records_dropped, 1);
+            return;
+        }
+        sched_yield();
+    }
+}
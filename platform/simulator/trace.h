@@ -0,0 +1,43 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Output trace. Records go into a lock-free ring and a background thread
+// writes them out, so that tracing never does I/O on the clock path.
+
+typedef enum {
+    kTraceTrigger = 0,  // a trigger output changed, index is the output
+    kTraceClock = 1,    // the clock output changed
+} trace_event_t;
+
+// 16 bytes in native byte order, as written to binary traces
+typedef struct {
+    int64_t at;     // ns, from get_time()
+    uint8_t event;  // trace_event_t
+    uint8_t index;
+    uint8_t value;
+    uint8_t reserved[5];
+} trace_record_t;
+
+typedef struct {
+    bool binary;  // raw trace_record_t rather than the human format
+    // wait for the writer when the ring is full instead of dropping the
+    // record, for when there is no real time to keep up with
+    bool block_when_full;
+} trace_options_t;
+
+// start the writer thread, out is left open on trace_stop(). The human
+// format has "T<n>" for each trigger that fires and a new line per clock
+// cycle.
+bool trace_start(FILE *out, const trace_options_t *options);
+// write out everything recorded so far and stop the writer thread, once
+// nothing is recording any more
+void trace_stop(void);
+
+// from a single thread at a time, does nothing if the trace isn't running
+void trace_record(trace_event_t event, uint8_t index, uint8_t value);
+
+#endif
@@ -0,0 +1,191 @@
+#include "vgrid.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "timespec.h"
+
+typedef struct {
+    struct timespec at;
+    uint8_t x;
+    uint8_t y;
+    uint8_t z;
+} vgrid_key_t;
+
+typedef struct {
+    struct timespec at;  // time since the grid was opened
+    uint8_t x_off;
+    uint8_t y_off;
+    uint8_t width;   // 8 for a map or row, 1 for a single LED
+    uint8_t height;  // 8 for a map, 1 for a row or single LED
+    uint8_t data[64];
+} vgrid_frame_t;
+
+static uint8_t leds[VGRID_SIZE][VGRID_SIZE] = { { 0 } };
+
+// scripted key events, sorted by time
+static vgrid_key_t *keys = NULL;
+static size_t keys_len = 0;
+static size_t keys_next = 0;
+
+// captured frames, grown as needed
+static vgrid_frame_t *frames = NULL;
+static size_t frames_len = 0;
+static size_t frames_cap = 0;
+
+static int key_compare(const void *a, const void *b) {
+    const vgrid_key_t *ka = a;
+    const vgrid_key_t *kb = b;
+    if (timespec_lt(ka->at, kb->at)) return -1;
+    if (timespec_gt(ka->at, kb->at)) return 1;
+    return 0;
+}
+
+static bool load_script(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        printf("Could not open grid script %s\n", path);
+        return false;
+    }
+
+    size_t cap = 0;
+    char line[256];
+    unsigned int line_no = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_no++;
+        char *l = line + strspn(line, " \t");
+        if (*l == '#' || *l == '\n' || *l == '\0') continue;
+
+        long ms;
+        unsigned int x, y, z;
+        if (sscanf(l, "%ld %u %u %u", &ms, &x, &y, &z) != 4 ||
+            x >= VGRID_SIZE || y >= VGRID_SIZE || z > 1 || ms < 0) {
+            printf("%s:%u: expected '<ms> <x> <y> <z>'\n", path, line_no);
+            fclose(f);
+            return false;
+        }
+
+        if (keys_len == cap) {
+            cap = cap ? cap * 2 : 64;
+            keys = realloc(keys, cap * sizeof(vgrid_key_t));
+            if (!keys) abort();
+        }
+        keys[keys_len++] = (vgrid_key_t){ .at = timespec_from_ms(ms),
+                                          .x = (uint8_t)x,
+                                          .y = (uint8_t)y,
+                                          .z = (uint8_t)z };
+    }
+    fclose(f);
+
+    qsort(keys, keys_len, sizeof(vgrid_key_t), key_compare);
+    return true;
+}
+
+bool vgrid_open(const char *script_path) {
+    memset(leds, 0, sizeof(leds));
+    keys_len = 0;
+    keys_next = 0;
+    frames_len = 0;
+
+    if (script_path) return load_script(script_path);
+    return true;
+}
+
+void vgrid_close(void) {
+    free(keys);
+    keys = NULL;
+    keys_len = keys_next = 0;
+
+    free(frames);
+    frames = NULL;
+    frames_len = frames_cap = 0;
+}
+
+bool vgrid_next_key_time(struct timespec *when) {
+    if (keys_next >= keys_len) return false;
+    *when = keys[keys_next].at;
+    return true;
+}
+
+bool vgrid_next_key(struct timespec elapsed, uint8_t *x, uint8_t *y,
+                    uint8_t *z) {
+    if (keys_next >= keys_len) return false;
+    if (timespec_lt(elapsed, keys[keys_next].at)) return false;
+
+    const vgrid_key_t *k = &keys[keys_next++];
+    *x = k->x;
+    *y = k->y;
+    *z = k->z;
+    return true;
+}
+
+static void capture(struct timespec elapsed, uint8_t x_off, uint8_t y_off,
+                    uint8_t width, uint8_t height) {
+    if (frames_len == frames_cap) {
+        frames_cap = frames_cap ? frames_cap * 2 : 1024;
+        frames = realloc(frames, frames_cap * sizeof(vgrid_frame_t));
+        if (!frames) abort();
+    }
+    vgrid_frame_t *f = &frames[frames_len++];
+    f->at = elapsed;
+    f->x_off = x_off;
+    f->y_off = y_off;
+    f->width = width;
+    f->height = height;
+    for (uint8_t y = 0; y < height; y++) {
+        memcpy(&f->data[y * width], &leds[y_off + y][x_off], width);
+    }
+}
+
+void vgrid_led_level_map(struct timespec elapsed, uint8_t x_off,
+                         uint8_t y_off, const uint8_t *data) {
+    if (x_off > VGRID_SIZE - 8 || y_off > VGRID_SIZE - 8) return;
+
+    for (uint8_t y = 0; y < 8; y++) {
+        memcpy(&leds[y_off + y][x_off], &data[y * 8], 8);
+    }
+    capture(elapsed, x_off, y_off, 8, 8);
+}
+
+void vgrid_led_level_row(struct timespec elapsed, uint8_t x_off, uint8_t y,
+                         const uint8_t *data) {
+    if (x_off > VGRID_SIZE - 8 || y >= VGRID_SIZE) return;
+
+    memcpy(&leds[y][x_off], data, 8);
+    capture(elapsed, x_off, y, 8, 1);
+}
+
+void vgrid_led_level_set(struct timespec elapsed, uint8_t x, uint8_t y,
+                         uint8_t level) {
+    if (x >= VGRID_SIZE || y >= VGRID_SIZE) return;
+
+    leds[y][x] = level;
+    capture(elapsed, x, y, 1, 1);
+}
+
+void vgrid_led_all(uint8_t level) {
+    memset(leds, level, sizeof(leds));
+}
+
+size_t vgrid_frame_count(void) {
+    return frames_len;
+}
+
+bool vgrid_write_frames(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) return false;
+
+    for (size_t i = 0; i < frames_len; i++) {
+        const vgrid_frame_t *fr = &frames[i];
+        fprintf(f, "%ld.%09ld %u %u %u %u ", (long)fr->at.tv_sec,
+                (long)fr->at.tv_nsec, fr->x_off, fr->y_off, fr->width,
+                fr->height);
+        for (size_t j = 0; j < (size_t)(fr->width * fr->height); j++) {
+            fprintf(f, "%x", fr->data[j]);
+        }
+        fputc('\n', f);
+    }
+
+    return fclose(f) == 0;
+}
@@ -0,0 +1,39 @@
+#ifndef _VGRID_H_
+#define _VGRID_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// An in-process stand in for a 16x16 monome grid. Key presses are read from a
+// script and every LED update (map, row or single LED) is captured in memory.
+
+#define VGRID_SIZE 16
+
+// script_path is a text file with one key event per line:
+//   <milliseconds> <x> <y> <z>
+// blank lines and lines starting with '#' are ignored, NULL means no keys
+bool vgrid_open(const char *script_path);
+void vgrid_close(void);
+
+// time of the next scripted key event, false if there are none left
+bool vgrid_next_key_time(struct timespec *when);
+// pop the next key event if it is due at elapsed
+bool vgrid_next_key(struct timespec elapsed, uint8_t *x, uint8_t *y,
+                    uint8_t *z);
+
+void vgrid_led_level_map(struct timespec elapsed, uint8_t x_off,
+                         uint8_t y_off, const uint8_t *data);
+void vgrid_led_level_row(struct timespec elapsed, uint8_t x_off, uint8_t y,
+                         const uint8_t *data);
+void vgrid_led_level_set(struct timespec elapsed, uint8_t x, uint8_t y,
+                         uint8_t level);
+void vgrid_led_all(uint8_t level);
+
+size_t vgrid_frame_count(void);
+// one frame per line:
+//   <seconds> <x_off> <y_off> <width> <height> <width * height hex levels>
+bool vgrid_write_frames(const char *path);
+
+#endif